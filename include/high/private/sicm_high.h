@@ -38,7 +38,6 @@ use_tree(deviceptr, int);
  */
 extern extent_arr *extents;
 extern extent_arr *rss_extents;
-extern pthread_rwlock_t extents_lock;
 extern arena_info **arenas;
 extern tree(unsigned, deviceptr) site_nodes;
 extern int should_profile_all, should_profile_one, should_profile_rss, should_profile_online;
@@ -69,4 +68,5 @@ void* sh_realloc(int id, void *ptr, size_t sz);
 void sh_create_extent(void *begin, void *end);
 
 void sh_free(void* ptr);
+void sh_free_sized(void* ptr, size_t sz);
 int get_arena_index(int id);
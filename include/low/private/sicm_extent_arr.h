@@ -1,52 +1,241 @@
 #pragma once
-/* extent_arr is an array of jemalloc extents. Each element of
- * the array stores a start and end address, as well as a pointer to an arena.
- * This is designed to be extremely cache-friendly, and thus makes some 
- * sacrifices in the runtime complexity department. It's extremely fast
- * for use cases where we need to iterate over all of the extents in the array
- * very quickly, which we do when we rebind an arena or when we search
- * all allocated extents while profiling.
+/* extent_arr is an ordered index of jemalloc extents. Each element stores a
+ * start and end address, as well as a pointer to an arena.
+ *
+ * The index is a B+ tree keyed by the start address of the extents. The
+ * leaves hold the extents themselves in sorted, contiguous arrays and are
+ * linked together, so iterating over all of the extents (which we do when
+ * we rebind an arena or sum up the RSS while profiling) is still a walk
+ * over a few large arrays. Insertion, deletion and finding the extent that
+ * contains an address are O(log n).
+ *
+ * Writers are serialized by a mutex. Lookups don't take it: they are
+ * protected by a sequence counter and retry if a writer got in the way.
+ * To make that safe, nodes are never given back to the system while the
+ * index exists, and leaves and inner nodes are never reused as one another,
+ * so a lookup racing with a writer only ever reads stale, but valid, nodes.
+ *
+ * Iterating with extent_arr_for requires holding the mutex (extent_arr_lock).
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <pthread.h>
 
+/* Number of entries in each node */
+#define EXTENT_ARR_ORDER 32
+/* Enough for any tree that fits into memory */
+#define EXTENT_ARR_MAX_DEPTH 32
+
 /* Stores information about a jemalloc extent */
 typedef struct extent_info {
   void *start, *end;
   void *arena;
 } extent_info;
 
+/* Common header of inner nodes and leaves */
+typedef struct extent_node {
+  int leaf;
+  unsigned count;
+  struct extent_node *free_next; /* Next node in the free list */
+  struct extent_node *pool_next; /* Next node ever allocated by this index */
+} extent_node;
+
+typedef struct extent_inner {
+  extent_node hdr;
+  void *keys[EXTENT_ARR_ORDER]; /* keys[0] is unused */
+  extent_node *children[EXTENT_ARR_ORDER];
+} extent_inner;
+
+typedef struct extent_leaf {
+  extent_node hdr;
+  struct extent_leaf *prev, *next;
+  extent_info ext[EXTENT_ARR_ORDER];
+} extent_leaf;
+
 typedef struct extent_arr {
   pthread_mutex_t mutex;
-  size_t max_extents, index, deleted;
-  extent_info *arr;
+  unsigned seq; /* Odd while a writer is modifying the tree */
+  size_t count;
+  extent_node *root;
+  extent_leaf *first;
+  extent_node *free_inner, *free_leaves, *pool;
 } extent_arr;
 
-#define extent_arr_for(a, i) \
-  for(i = 0; i < a->index; i++)
+/* Iterates over all extents in order. `n` is an (extent_leaf *), `i` a size_t
+ * index into n->ext. `break` only leaves the inner loop.
+ */
+#define extent_arr_for(a, n, i) \
+  for(n = (a)->first; n != NULL; n = n->next) \
+    for(i = 0; i < n->hdr.count; i++)
+
+#define extent_arr_lock(a) pthread_mutex_lock(&(a)->mutex)
+#define extent_arr_unlock(a) pthread_mutex_unlock(&(a)->mutex)
+
+static inline extent_node *extent_arr_node_new(extent_arr *a, int leaf) {
+  extent_node *n, **free_list;
+
+  free_list = leaf ? &a->free_leaves : &a->free_inner;
+  if(*free_list) {
+    n = *free_list;
+    *free_list = n->free_next;
+  } else {
+    n = (extent_node *) calloc(1, leaf ? sizeof(extent_leaf) : sizeof(extent_inner));
+    if(!n) {
+      fprintf(stderr, "Failed to allocate an extent index node. Aborting.\n");
+      exit(1);
+    }
+    n->leaf = leaf;
+    n->pool_next = a->pool;
+    a->pool = n;
+  }
+  n->count = 0;
+  n->free_next = NULL;
+
+  return n;
+}
+
+static inline void extent_arr_node_release(extent_arr *a, extent_node *n) {
+  extent_node **free_list;
+
+  free_list = n->leaf ? &a->free_leaves : &a->free_inner;
+  n->free_next = *free_list;
+  *free_list = n;
+}
+
+static inline void extent_arr_write_begin(extent_arr *a) {
+  __atomic_store_n(&a->seq, a->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void extent_arr_write_end(extent_arr *a) {
+  __atomic_store_n(&a->seq, a->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Index of the child of an inner node that `addr` belongs to */
+static inline unsigned extent_arr_route(extent_inner *n, void *addr) {
+  unsigned lo, hi, mid, count;
+
+  count = n->hdr.count;
+  if(count > EXTENT_ARR_ORDER) {
+    count = EXTENT_ARR_ORDER;
+  }
+
+  /* Last index in [1, count) whose key is <= addr, or 0 */
+  lo = 1;
+  hi = count;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if((uintptr_t) n->keys[mid] <= (uintptr_t) addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo - 1;
+}
+
+/* Number of extents in a leaf that start at or below `addr` */
+static inline unsigned extent_arr_leaf_upper(extent_leaf *l, void *addr) {
+  unsigned lo, hi, mid, count;
+
+  count = l->hdr.count;
+  if(count > EXTENT_ARR_ORDER) {
+    count = EXTENT_ARR_ORDER;
+  }
+
+  lo = 0;
+  hi = count;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if((uintptr_t) l->ext[mid].start <= (uintptr_t) addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
 
 static inline extent_arr *extent_arr_init() {
   extent_arr *a;
-  size_t i;
 
-  a = (extent_arr *) malloc(sizeof(extent_arr));
-  a->max_extents = 2;
-  a->index = 0;
-  a->deleted = 0;
-  pthread_mutex_init(&a->mutex, NULL);
-  a->arr = (extent_info *) malloc(sizeof(extent_info) * a->max_extents);
-  extent_arr_for(a, i) {
-    a->arr[i].start = NULL;
-    a->arr[i].end = NULL;
-    a->arr[i].arena = NULL;
+  a = (extent_arr *) calloc(1, sizeof(extent_arr));
+  if(!a) {
+    fprintf(stderr, "Failed to allocate the extent index. Aborting.\n");
+    exit(1);
   }
+  pthread_mutex_init(&a->mutex, NULL);
+  a->root = extent_arr_node_new(a, 1);
+  a->first = (extent_leaf *) a->root;
+
   return a;
 }
 
+/* Inserts `key`/`child` at position `pos` of the inner node at `path[depth]`,
+ * splitting nodes up the path as needed.
+ */
+static inline void extent_arr_inner_insert(extent_arr *a, extent_inner **path, unsigned *idx,
+                                           int depth, unsigned pos, void *key, extent_node *child) {
+  extent_inner *n, *r, *root;
+  unsigned half;
+
+  while(depth >= 0) {
+    n = path[depth];
+    if(n->hdr.count < EXTENT_ARR_ORDER) {
+      memmove(&n->keys[pos + 1], &n->keys[pos], (n->hdr.count - pos) * sizeof(void *));
+      memmove(&n->children[pos + 1], &n->children[pos], (n->hdr.count - pos) * sizeof(extent_node *));
+      n->keys[pos] = key;
+      n->children[pos] = child;
+      n->hdr.count++;
+      return;
+    }
+
+    /* Split the node in half, the upper half goes to r */
+    half = EXTENT_ARR_ORDER / 2;
+    r = (extent_inner *) extent_arr_node_new(a, 0);
+    memcpy(r->keys, &n->keys[half], (EXTENT_ARR_ORDER - half) * sizeof(void *));
+    memcpy(r->children, &n->children[half], (EXTENT_ARR_ORDER - half) * sizeof(extent_node *));
+    r->hdr.count = EXTENT_ARR_ORDER - half;
+    n->hdr.count = half;
+    if(pos >= half) {
+      pos -= half;
+      n = r;
+    }
+    memmove(&n->keys[pos + 1], &n->keys[pos], (n->hdr.count - pos) * sizeof(void *));
+    memmove(&n->children[pos + 1], &n->children[pos], (n->hdr.count - pos) * sizeof(extent_node *));
+    n->keys[pos] = key;
+    n->children[pos] = child;
+    n->hdr.count++;
+
+    /* Now insert r into the parent */
+    key = r->keys[0];
+    child = (extent_node *) r;
+    depth--;
+    if(depth >= 0) {
+      pos = idx[depth] + 1;
+    }
+  }
+
+  /* The root was split */
+  root = (extent_inner *) extent_arr_node_new(a, 0);
+  root->keys[0] = NULL;
+  root->children[0] = a->root;
+  root->keys[1] = key;
+  root->children[1] = child;
+  root->hdr.count = 2;
+  a->root = (extent_node *) root;
+}
+
 static inline void extent_arr_insert(extent_arr *a, void *start, void *end, void *arena) {
-  size_t old_max_extents, i, found;
+  extent_inner *path[EXTENT_ARR_MAX_DEPTH];
+  unsigned idx[EXTENT_ARR_MAX_DEPTH], pos, half;
+  extent_node *n;
+  extent_leaf *l, *r;
+  int depth;
 
   if(!a) {
     fprintf(stderr, "Extent array is NULL. Aborting.\n");
@@ -54,49 +243,63 @@ static inline void extent_arr_insert(extent_arr *a, void *start, void *end, void
   }
 
   pthread_mutex_lock(&a->mutex);
+  extent_arr_write_begin(a);
 
-  /* First search for a blank spot */
-  found = SIZE_MAX;
-  if(a->deleted > 0) {
-    extent_arr_for(a, i) {
-      /* Empty element when both addresses are NULL */
-      if(!a->arr[i].start && !a->arr[i].end) {
-        found = i;
-        break;
-      }
-    }
+  /* Find the leaf */
+  depth = 0;
+  n = a->root;
+  while(!n->leaf) {
+    path[depth] = (extent_inner *) n;
+    idx[depth] = extent_arr_route((extent_inner *) n, start);
+    n = path[depth]->children[idx[depth]];
+    depth++;
   }
+  l = (extent_leaf *) n;
+  pos = extent_arr_leaf_upper(l, start);
 
-  /* If we didn't find a deleted element, add to the array and possibly expand it */
-  if(found == SIZE_MAX) {
-    found = a->index;
-    /* Now expand the array to allow for more items */
-    if(a->index == a->max_extents - 1) {
-      /* We need to reallocate */
-      old_max_extents = a->max_extents;
-      a->max_extents *= 2;
-      a->arr = realloc(a->arr, a->max_extents * sizeof(extent_info));
-      for(i = old_max_extents; i < a->max_extents; i++) {
-        a->arr[i].start = NULL;
-        a->arr[i].end = NULL;
-        a->arr[i].arena = NULL;
-      }
+  if(l->hdr.count == EXTENT_ARR_ORDER) {
+    /* Split the leaf, the upper half goes to r */
+    half = EXTENT_ARR_ORDER / 2;
+    r = (extent_leaf *) extent_arr_node_new(a, 1);
+    memcpy(r->ext, &l->ext[half], (EXTENT_ARR_ORDER - half) * sizeof(extent_info));
+    r->hdr.count = EXTENT_ARR_ORDER - half;
+    l->hdr.count = half;
+    r->prev = l;
+    r->next = l->next;
+    if(l->next) {
+      l->next->prev = r;
+    }
+    l->next = r;
+
+    if(depth > 0) {
+      extent_arr_inner_insert(a, path, idx, depth - 1, idx[depth - 1] + 1, r->ext[0].start, (extent_node *) r);
+    } else {
+      extent_arr_inner_insert(a, path, idx, -1, 0, r->ext[0].start, (extent_node *) r);
+    }
+
+    if(pos > half) {
+      pos -= half;
+      l = r;
     }
-    a->index++;
-  } else {
-    a->deleted--;
   }
 
-  /* Insert either into the deleted element or what a->index used to be */
-  a->arr[found].start = start;
-  a->arr[found].end = end;
-  a->arr[found].arena = arena;
+  memmove(&l->ext[pos + 1], &l->ext[pos], (l->hdr.count - pos) * sizeof(extent_info));
+  l->ext[pos].start = start;
+  l->ext[pos].end = end;
+  l->ext[pos].arena = arena;
+  l->hdr.count++;
+  a->count++;
 
+  extent_arr_write_end(a);
   pthread_mutex_unlock(&a->mutex);
 }
 
 static inline void extent_arr_delete(extent_arr *a, void *start) {
-  size_t i;
+  extent_inner *path[EXTENT_ARR_MAX_DEPTH], *p;
+  unsigned idx[EXTENT_ARR_MAX_DEPTH], pos;
+  extent_node *n;
+  extent_leaf *l;
+  int depth;
 
   if(!a) {
     fprintf(stderr, "Extent array is NULL. Aborting.\n");
@@ -105,20 +308,162 @@ static inline void extent_arr_delete(extent_arr *a, void *start) {
 
   pthread_mutex_lock(&a->mutex);
 
-  extent_arr_for(a, i) {
-    if(a->arr[i].start == start) {
-      a->arr[i].start = NULL;
-      a->arr[i].end = NULL;
-      a->arr[i].arena = NULL;
-      a->deleted++;
-      break;
+  depth = 0;
+  n = a->root;
+  while(!n->leaf) {
+    path[depth] = (extent_inner *) n;
+    idx[depth] = extent_arr_route((extent_inner *) n, start);
+    n = path[depth]->children[idx[depth]];
+    depth++;
+  }
+  l = (extent_leaf *) n;
+  pos = extent_arr_leaf_upper(l, start);
+  if(pos == 0 || l->ext[pos - 1].start != start) {
+    /* Not in the index */
+    pthread_mutex_unlock(&a->mutex);
+    return;
+  }
+  pos--;
+
+  extent_arr_write_begin(a);
+
+  memmove(&l->ext[pos], &l->ext[pos + 1], (l->hdr.count - pos - 1) * sizeof(extent_info));
+  l->hdr.count--;
+  a->count--;
+
+  /* Get rid of empty nodes, but never of the root */
+  if(l->hdr.count == 0 && depth > 0) {
+    if(l->prev) {
+      l->prev->next = l->next;
+    } else {
+      a->first = l->next;
+    }
+    if(l->next) {
+      l->next->prev = l->prev;
+    }
+    extent_arr_node_release(a, (extent_node *) l);
+
+    while(depth > 0) {
+      depth--;
+      p = path[depth];
+      pos = idx[depth];
+      memmove(&p->keys[pos], &p->keys[pos + 1], (p->hdr.count - pos - 1) * sizeof(void *));
+      memmove(&p->children[pos], &p->children[pos + 1], (p->hdr.count - pos - 1) * sizeof(extent_node *));
+      p->hdr.count--;
+      if(p->hdr.count > 0 || depth == 0) {
+        break;
+      }
+      extent_arr_node_release(a, (extent_node *) p);
+    }
+
+    /* Shrink the tree while the root has a single child */
+    while(!a->root->leaf && a->root->count == 1) {
+      n = a->root;
+      a->root = ((extent_inner *) n)->children[0];
+      extent_arr_node_release(a, n);
     }
   }
 
+  extent_arr_write_end(a);
   pthread_mutex_unlock(&a->mutex);
 }
 
+/* Changes the end of the extent that starts at `start`. Lookups see either
+ * the old or the new end. Returns 0 if there is no such extent.
+ */
+static inline int extent_arr_set_end(extent_arr *a, void *start, void *end) {
+  extent_node *n;
+  extent_leaf *l;
+  unsigned pos;
+
+  pthread_mutex_lock(&a->mutex);
+  n = a->root;
+  while(!n->leaf) {
+    n = ((extent_inner *) n)->children[extent_arr_route((extent_inner *) n, start)];
+  }
+  l = (extent_leaf *) n;
+  pos = extent_arr_leaf_upper(l, start);
+  if(pos == 0 || l->ext[pos - 1].start != start) {
+    pthread_mutex_unlock(&a->mutex);
+    return 0;
+  }
+
+  extent_arr_write_begin(a);
+  l->ext[pos - 1].end = end;
+  extent_arr_write_end(a);
+  pthread_mutex_unlock(&a->mutex);
+  return 1;
+}
+
+/* One attempt at a lookup, without any synchronization. Returns 1 and fills
+ * in `out` if an extent contains `addr`, 0 if none does, and -1 if a
+ * concurrent writer left the tree in a state that can't be walked.
+ */
+static inline int extent_arr_lookup_unlocked(extent_arr *a, void *addr, extent_info *out) {
+  extent_node *n;
+  extent_leaf *l;
+  unsigned pos;
+  int depth;
+
+  n = __atomic_load_n(&a->root, __ATOMIC_RELAXED);
+  for(depth = 0; n && !n->leaf; depth++) {
+    if(depth == EXTENT_ARR_MAX_DEPTH) {
+      return -1;
+    }
+    n = ((extent_inner *) n)->children[extent_arr_route((extent_inner *) n, addr)];
+  }
+  if(!n) {
+    return -1;
+  }
+
+  /* The extent containing addr is the one with the greatest start <= addr,
+   * which is either in this leaf or the last one of the previous leaf.
+   */
+  l = (extent_leaf *) n;
+  pos = extent_arr_leaf_upper(l, addr);
+  if(pos == 0) {
+    l = l->prev;
+    if(!l) {
+      return 0;
+    }
+    pos = l->hdr.count;
+    if(pos == 0 || pos > EXTENT_ARR_ORDER) {
+      return -1;
+    }
+  }
+
+  *out = l->ext[pos - 1];
+  return (uintptr_t) addr >= (uintptr_t) out->start && (uintptr_t) addr < (uintptr_t) out->end;
+}
+
+/* Finds the extent that contains `addr`. Returns 1 and fills in `out` if
+ * there is one, 0 otherwise. Doesn't block, unless a writer is in the
+ * middle of modifying the index.
+ */
+static inline int extent_arr_lookup(extent_arr *a, void *addr, extent_info *out) {
+  unsigned seq;
+  int ret;
+
+  for(;;) {
+    seq = __atomic_load_n(&a->seq, __ATOMIC_ACQUIRE);
+    if(seq & 1) {
+      continue;
+    }
+    ret = extent_arr_lookup_unlocked(a, addr, out);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&a->seq, __ATOMIC_RELAXED) == seq && ret >= 0) {
+      return ret;
+    }
+  }
+}
+
 static inline void extent_arr_free(extent_arr *a) {
-  free(a->arr);
+  extent_node *n, *next;
+
+  for(n = a->pool; n != NULL; n = next) {
+    next = n->pool_next;
+    free(n);
+  }
+  pthread_mutex_destroy(&a->mutex);
   free(a);
 }
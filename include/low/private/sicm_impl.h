@@ -77,6 +77,46 @@ extern int normal_page_size;
     (char *)(member_type(type, member) *){ ptr } - offsetof(type, member)))
 
 typedef struct sarena sarena;
+typedef struct sa_override sa_override;
+
+/* Maximum number of nodes an arena keeps track of individually */
+#define SARENA_MAX_NODES 64
+
+/* Nodes of an arena's devices, in the order of its device list */
+typedef struct sarena_nodes {
+    unsigned            count;
+    int                 node[SARENA_MAX_NODES];
+    unsigned            weight[SARENA_MAX_NODES];	// SICM_ALLOC_WEIGHTED stripes per cycle
+    unsigned            total;		// sum of the weights
+} sarena_nodes;
+
+/* Maximum number of extents an arena keeps for reuse */
+#define SARENA_CACHE_EXTENTS 64
+/* Default limit of the memory an arena keeps for reuse */
+#define SARENA_CACHE_DEFAULT (64UL << 20)
+
+/* An extent kept mapped by the arena after jemalloc released it */
+typedef struct sarena_cached {
+    void*               start;
+    size_t              size;
+    unsigned            policy_gen;	// arena's policy_gen when it was bound
+} sarena_cached;
+
+/* Files of file-backed arenas grow in steps of this size */
+#define SARENA_FILE_CHUNK (64L << 20)
+
+#define SARENA_PERSIST_MAGIC 0x5352455049434953ULL	// "SICIPERS"
+#define SARENA_PERSIST_VERSION 1
+
+/* Header at the start of a persistent arena's file (and mapping) */
+typedef struct sarena_persist {
+    uint64_t            magic;		// written last when the file is created
+    uint64_t            version;
+    uint64_t            base;		// address the file is always mapped at
+    uint64_t            capacity;	// size of the mapping
+    uint64_t            used;		// bytes from base given out to extents
+    uint64_t            root;		// root object, see sicm_arena_set_root
+} sarena_persist;
 
 
 /* Stores information about a jemalloc arena */
@@ -87,17 +127,55 @@ struct sarena {
     size_t              maxsize;	// 0 is unlimited
     size_t              size;		// curent size of all extents
     struct bitmask*	nodemask;
+    sarena_nodes        nodes;
+    int                 mpol;		// memory policy used to mbind the extents
+    size_t              pgsz;		// page size of new extents in bytes
+    unsigned            policy_gen;	// bumped whenever nodemask changes
     sarena*             next;
 
     /* jemalloc related */
     unsigned            arena_ind;
     extent_hooks_t      hooks;
 
+    /* explicit tcaches, only used with SICM_ALLOC_TCACHE */
+    unsigned long       serial;		// unique for the lifetime of the process
+    unsigned            tcache_gen;	// bumped to make threads flush their tcaches
+    unsigned*           tcaches;	// tcache indices created for this arena
+    size_t              ntcaches, maxtcaches;
+
     /* jemalloc extent ranges */
     extent_arr*         extents;
+    extent_arr*         huge_extents;	// hugetlb mappings, arena field is the page size
+
+    /* devices that extents spill over to once maxsize is reached, in order */
+    sicm_device_list    fallback;
+    size_t*             fallback_size;	// bytes of extents on each fallback device
+    size_t              spilled, peak_spilled;	// bytes on all fallback devices
+    size_t              weighted_cuts;	// stripe boundaries inside the extents, see sa_weighted_cuts
+
+    /* ranges moved with sicm_arena_move_range, unsorted */
+    sa_override*        overrides;
+    size_t              noverrides, maxoverrides;
+    size_t*             moved;	// bytes of the overrides on each node, see sa_override_account
+
+    /* how new extents are faulted in, see sicm_arena_set_populate */
+    int                 populate;
+    int                 populate_threads;
+
+    /* released extents that are reused before mapping new ones */
+    sarena_cached       cache[SARENA_CACHE_EXTENTS];
+    unsigned            ncached;
+    size_t              cached, max_cached;	// bytes in the cache, high-water mark
+
+    /* asynchronous migration; extents aren't unmapped while it runs */
+    pthread_rwlock_t    migrate_lock;	// protects migration
+    sicm_migration*     migration;
 
     int                 err;
     int                 fd;
+    off_t               file_off;	// offset of the next extent in the file
+    off_t               file_size;	// size the file was grown to
+    sarena_persist*     persist;	// header and start of a persistent arena's mapping
 };
 
 extern sarena *sarena_ptr2sarena(void *ptr);
@@ -51,12 +51,16 @@ public:
         typedef SICMAllocator<U> other;
     };
 
-    SICMAllocator(sicm_device *dev = sicm_default_device(-1)) throw() {
+    // If arena isn't ARENA_DEFAULT, memory comes from it instead of dev.
+    SICMAllocator(sicm_device *dev = sicm_default_device(-1),
+                  sicm_arena arena = ARENA_DEFAULT) throw() {
         sicm_dev = dev;
+        sicm_arena_ = arena;
     }
 
     template <class U> SICMAllocator(SICMAllocator<U> const& u) throw() {
         sicm_dev = u.sicm_dev;
+        sicm_arena_ = u.sicm_arena_;
     }
 
     pointer
@@ -64,7 +68,12 @@ public:
     {
         void *mem = NULL;
 
-        if (sicm_dev) {
+        if (sicm_arena_) {
+            if (!(mem = sicm_arena_alloc(sicm_arena_, n * sizeof(value_type)))) {
+                throw std::bad_alloc();
+            }
+        }
+        else if (sicm_dev) {
             if (!(mem = sicm_device_alloc(sicm_dev, n * sizeof(value_type)))) {
                 throw std::bad_alloc();
             }
@@ -79,7 +88,10 @@ public:
     void
     deallocate(pointer p, size_type n)
     {
-        if (sicm_dev) {
+        if (sicm_arena_) {
+            sicm_arena_free(sicm_arena_, p, n * sizeof(value_type));
+        }
+        else if (sicm_dev) {
             sicm_device_free(sicm_dev, p, n * sizeof(value_type));
         }
         else {
@@ -118,13 +130,15 @@ public:
     }
 
     sicm_device *sicm_dev;
+    sicm_arena sicm_arena_;
 };
 
 template <class T, class U>
 bool
-operator==(SICMAllocator<T> const&, SICMAllocator<U> const&)
+operator==(SICMAllocator<T> const& x, SICMAllocator<U> const& y)
 {
-    return true;
+    // memory can only be freed through the device or arena it came from
+    return x.sicm_dev == y.sicm_dev && x.sicm_arena_ == y.sicm_arena_;
 }
 
 template <class T, class U>
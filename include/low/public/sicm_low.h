@@ -47,8 +47,20 @@ typedef enum sicm_arena_flags {
   SICM_ALLOC_MASK    = 7,	// lowest 3 bits
   SICM_ALLOC_STRICT  = 0,	// don't use any devices outside of the assigned
   SICM_ALLOC_RELAXED = 1,	// prefer the assigned devices, but use other memory too
+  SICM_ALLOC_INTERLEAVE = 2,	// interleave the pages over the assigned devices
+  SICM_ALLOC_WEIGHTED = 3,	// stripe the pages over the devices by their weights
+  SICM_ALLOC_ORDERED = 4,	// prefer the first device with enough free memory
+  SICM_ALLOC_TCACHE  = 8,	// cache small allocations in per-thread caches
+  SICM_ALLOC_THP     = 16,	// back the arena with transparent huge pages
 } sicm_arena_flags;
 
+/// How an arena faults in the memory of new extents
+typedef enum sicm_populate_mode {
+  SICM_POPULATE_EAGER = 0,	// fault in each extent in the allocating thread (default)
+  SICM_POPULATE_LAZY = 1,	// leave the pages to be faulted in on first touch
+  SICM_POPULATE_PARALLEL = 2,	// fault in large extents with threads on the arena's nodes
+} sicm_populate_mode;
+
 /// Data specific to a DRAM device.
 typedef struct sicm_dram_data {
   char pad;  // padding to make this struct have the same size in C and C++
@@ -83,6 +95,42 @@ typedef union sicm_device_data {
   sicm_optane_data optane;
 } sicm_device_data;
 
+/// Kind of pages that back a device allocation.
+/**
+ * Huge page devices try reserved hugetlb pages first, then fall back to
+ * transparent huge pages and finally to normal pages when the hugetlb
+ * pool of the node is exhausted.
+ */
+typedef enum sicm_backing {
+  SICM_BACKING_HUGETLB, ///< Reserved hugetlb pages
+  SICM_BACKING_THP,     ///< Huge-page aligned memory eligible for THP
+  SICM_BACKING_NORMAL,  ///< Normal pages
+  SICM_BACKING_COUNT
+} sicm_backing;
+
+/// Classes of initiators that performance attributes are reported for.
+/**
+ * These match the kernel's HMAT access classes in
+ * /sys/devices/system/node/nodeN/accessC.
+ */
+typedef enum sicm_access_class {
+  SICM_ACCESS_ANY = 0, ///< Best initiator of any kind, including devices
+  SICM_ACCESS_CPU = 1, ///< Best initiator with CPUs
+  SICM_ACCESS_CLASSES
+} sicm_access_class;
+
+/// Firmware-reported (HMAT) performance of a device.
+/**
+ * Bandwidths are in MiB/s and latencies in nanoseconds, as reported by
+ * the kernel. A value of 0 means the platform didn't report it.
+ */
+typedef struct sicm_device_perf {
+  unsigned int read_bandwidth;
+  unsigned int write_bandwidth;
+  unsigned int read_latency;
+  unsigned int write_latency;
+} sicm_device_perf;
+
 /// Tagged/discriminated union that fully identifies a device.
 /**
  * The combination of a sicm_device_tag and sicm_device_data identifies
@@ -95,6 +143,8 @@ typedef struct sicm_device {
   int node;              ///< NUMA node
   int page_size;         ///< Page size
   sicm_device_data data; ///< Per-type identifying information
+  size_t backing_count[SICM_BACKING_COUNT]; ///< Allocations served by each backing
+  sicm_device_perf perf[SICM_ACCESS_CLASSES]; ///< HMAT attributes read by sicm_init
 } sicm_device;
 
 /// Explicitly-sized sicm_device array.
@@ -113,6 +163,52 @@ typedef struct sicm_device_list {
  */
 sicm_device *sicm_default_device(const unsigned int idx);
 
+/// Get the device for a NUMA node and page size.
+/**
+ * @param[in] node NUMA node of the device.
+ * @param[in] page_size Page size of the device in KiB, or 0 for the
+ * normal page size.
+ * @return The device, or NULL if there is none.
+ *
+ * This is a constant-time lookup in a table built by sicm_init.
+ */
+sicm_device *sicm_node_device(int node, int page_size);
+
+/// Devices grouped into performance tiers.
+typedef struct sicm_tier_list {
+  unsigned int count;      ///< Number of tiers.
+  sicm_device_list* tiers; ///< Devices of each tier, fastest tier first.
+} sicm_tier_list;
+
+/// Group devices into tiers ordered from fastest to slowest.
+/**
+ * @param[in] initiator NUMA node the tiers are relative to, or -1 for
+ * the node of the calling CPU.
+ * @return The tiers; release them with sicm_tier_list_free.
+ *
+ * Nodes are ordered by the kernel's memory tier (abstract distance)
+ * where /sys/devices/virtual/memory_tiering exists, otherwise by HMAT
+ * read latency if every node reports it, and then by their SLIT
+ * distance from the initiator. Nodes that compare equal share a tier,
+ * and every device (page size) of a node is in the node's tier.
+ */
+sicm_tier_list sicm_device_tiers(int initiator);
+
+/// Index of the tier a device is in.
+/**
+ * @param[in] tiers Tiers from sicm_device_tiers.
+ * @param[in] device Device to look up.
+ * @return Index of the device's tier, or -1 if it isn't in any. The
+ * next faster tier has the index minus one, the next slower one plus one.
+ */
+int sicm_device_tier(sicm_tier_list *tiers, sicm_device *device);
+
+/// Release tiers from sicm_device_tiers.
+/**
+ * @param[in] tiers Tiers to release.
+ */
+void sicm_tier_list_free(sicm_tier_list *tiers);
+
 /// Results of a latency timing.
 /**
  * All times are in milliseconds.
@@ -124,6 +220,27 @@ struct sicm_timing {
   unsigned int free;    ///< Time required for deallocation.
 };
 
+/// Kernels of sicm_bandwidth, named after their STREAM counterparts.
+typedef enum sicm_bw_kernel {
+  SICM_BW_COPY,  ///< a[i] = b[i]
+  SICM_BW_SCALE, ///< a[i] = s * b[i]
+  SICM_BW_ADD,   ///< a[i] = b[i] + c[i]
+  SICM_BW_TRIAD, ///< a[i] = b[i] + s * c[i]
+  SICM_BW_READ,  ///< sum += b[i]
+  SICM_BW_WRITE, ///< a[i] = s
+} sicm_bw_kernel;
+
+/// Flags of sicm_bandwidth.
+#define SICM_BW_NONTEMPORAL 1 ///< Store with non-temporal (streaming) stores.
+#define SICM_BW_NOVECTOR    2 ///< Use the scalar kernels even if AVX2/AVX-512 is available.
+
+/// Bandwidths measured by sicm_bandwidth, in MB/s (10^6 bytes per second).
+typedef struct sicm_bw_result {
+  double best;   ///< Highest bandwidth of all repetitions.
+  double median; ///< Median bandwidth.
+  double stddev; ///< Standard deviation of the bandwidth.
+} sicm_bw_result;
+
 /// Handle to an arena.
 typedef void* sicm_arena;
 
@@ -133,6 +250,41 @@ typedef struct sicm_arena_list {
 	sicm_arena *arenas;
 } sicm_arena_list;
 
+/// Handle to an asynchronous arena migration.
+typedef struct sicm_migration sicm_migration;
+
+/// Handle to a set of arenas with one arena per NUMA node.
+typedef struct sicm_numa_arenas sicm_numa_arenas;
+
+/// Progress of an asynchronous arena migration.
+typedef struct sicm_migration_status {
+  size_t total;       ///< Bytes of extents that are being moved.
+  size_t moved;       ///< Bytes processed successfully so far.
+  size_t failed;      ///< Bytes that couldn't be moved.
+  size_t nfailures;   ///< Number of ranges that couldn't be (fully) moved.
+  int err;            ///< First error encountered, zero if none.
+  int done;           ///< Nonzero when the migration finished or was cancelled.
+  int cancelled;      ///< Nonzero if sicm_migration_cancel was called.
+} sicm_migration_status;
+
+/// Range of an arena that couldn't be (fully) moved.
+typedef struct sicm_migration_failure {
+  void *start;        ///< Start of the range.
+  void *end;          ///< End of the range.
+  int err;            ///< First error for the pages in the range.
+} sicm_migration_failure;
+
+/// Statistics of an arena, see sicm_arena_stats.
+typedef struct sicm_arena_statistics {
+  size_t allocated;   ///< Bytes of live allocations.
+  size_t active;      ///< Bytes of the pages that hold live allocations.
+  size_t resident;    ///< Bytes of resident memory, including jemalloc's metadata.
+  size_t retained;    ///< Bytes of virtual memory that jemalloc retains for reuse.
+  size_t dirty;       ///< Bytes of unused pages that weren't purged yet.
+  size_t muzzy;       ///< Bytes of unused pages that were lazily purged.
+  size_t mapped;      ///< Bytes of the extents that jemalloc got from the arena.
+} sicm_arena_statistics;
+
 /// Initialize the low-level interface.
 /**
  * Determine the total number of memory devices (which is the number of
@@ -174,17 +326,57 @@ sicm_arena_list *sicm_arenas_list();
 /// Create new arena
 /**
  * @param maxsize maximum size of the arena.
- * @param flags arena flags (currently unused)
+ * @param flags arena flags
  * @param devs devices that will be used for the arena's allocations
  * @return handle to the newly created arena, or ARENA_DEFAULT if the
  *         the function failed.
+ *
+ * If SICM_ALLOC_TCACHE is set, every thread that allocates from the arena
+ * gets its own jemalloc thread cache for it, so small allocations and
+ * frees don't take the arena's bin locks. The caches only ever hold memory
+ * from this arena. They are flushed when the thread exits and after the
+ * arena is moved with sicm_arena_set_devices.
+ *
+ * The lowest bits of flags select how the pages are placed on the devices:
+ * SICM_ALLOC_STRICT binds them to the devices. SICM_ALLOC_RELAXED prefers
+ * the devices, but falls back to other memory (with more than one device,
+ * this needs Linux 5.15, older kernels only prefer the first one).
+ * SICM_ALLOC_INTERLEAVE interleaves the pages over the devices.
+ * SICM_ALLOC_WEIGHTED spreads them in stripes by the weights set with
+ * sicm_arena_set_weights; with equal weights, the default, it interleaves
+ * the pages like SICM_ALLOC_INTERLEAVE. SICM_ALLOC_ORDERED places
+ * each extent on the first device in the list that has enough free
+ * memory for it, as last seen by sicm_avail, or on the last one.
+ *
+ * If the devices have a huge page size, the arena's extents are
+ * MAP_HUGETLB mappings of that page size, aligned to it. Their pages are
+ * only returned to the system when the arena is destroyed. For devices
+ * with the normal page size, SICM_ALLOC_THP aligns the extents to the
+ * transparent huge page size and marks them with MADV_HUGEPAGE instead.
  */
 sicm_arena sicm_arena_create(size_t maxsize, sicm_arena_flags flags, sicm_device_list *devs);
 
+/// Keep destroyed arenas for reuse
+/**
+ * @param n maximum number of arenas kept; the pool is filled up to n
+ *        right away
+ * @return zero if the operation is successful
+ *
+ * sicm_arena_destroy resets arenas created by sicm_arena_create (with the
+ * normal page size) and keeps them, up to n, instead of destroying them.
+ * sicm_arena_create then takes an arena from the pool and binds it to its
+ * devices, which is much cheaper than creating a jemalloc arena, and
+ * keeps the number of jemalloc arena indices in use bounded. A reused
+ * arena keeps the address space jemalloc retained, so sicm_arena_size
+ * isn't necessarily 0 for it. The pool is empty and disabled by default;
+ * sicm_init sets its size from the SICM_ARENA_POOL environment variable.
+ */
+int sicm_arena_pool_reserve(unsigned n);
+
 /// Create new mapped arena
 /**
  * @param maxsize maximum size of the arena.
- * @param flags arena flags (currently unused)
+ * @param flags arena flags
  * @param devs devices that will be used for the arena's allocations
  * @param fd A valid file descriptor to map the memory into
  * @param offset Starting offset within the file descriptor
@@ -192,10 +384,81 @@ sicm_arena sicm_arena_create(size_t maxsize, sicm_arena_flags flags, sicm_device
  * @param mutex_offset Starting offset within the mutex file descriptor
  * @return handle to the newly created arena, or ARENA_DEFAULT if the
  *         the function failed.
+ *
+ * Extents are mapped from consecutive ranges of the file, starting at
+ * offset. The file is grown in 64 MiB steps with fallocate (or ftruncate
+ * if the file system doesn't support it); it is never synced implicitly,
+ * see sicm_arena_sync.
  */
 sicm_arena sicm_arena_create_mmapped(size_t maxsize, sicm_arena_flags flags, sicm_device_list *devs, int fd,
 					off_t offset, int mutex_fd, off_t mutex_offset);
 
+/// Create or reopen a persistent arena
+/**
+ * @param path file that holds the arena's memory, created if it doesn't exist
+ * @param maxsize capacity of a new arena; ignored when reopening one
+ * @param flags arena flags
+ * @param devs devices that will be used for the arena's allocations; they
+ *        must support sicm_can_place_exact and use the normal page size
+ * @param base address to map the file at; NULL picks a free one for a new
+ *        arena and uses the recorded one when reopening
+ * @return handle to the arena, or ARENA_DEFAULT if the function failed
+ *         (e.g. the file isn't empty and isn't a persistent arena, or the
+ *         address range is in use).
+ *
+ * The whole file is mapped at the same address every time, so pointers
+ * stored in the arena stay valid across restarts. Allocations made after
+ * reopening the arena come from space that was never used before; the
+ * objects of earlier runs can be used in place, starting from the root
+ * object (see sicm_arena_get_root), but must not be freed or resized.
+ * Released memory is reused by jemalloc, but never returned to the file.
+ * sicm_arena_size only covers the current run.
+ */
+sicm_arena sicm_arena_open_persistent(const char *path, size_t maxsize, sicm_arena_flags flags,
+					sicm_device_list *devs, void *base);
+
+/// Get the root object of a persistent arena
+/**
+ * @param sa persistent arena
+ * @return the pointer set with sicm_arena_set_root, NULL if there is none
+ */
+void *sicm_arena_get_root(sicm_arena sa);
+
+/// Set the root object of a persistent arena
+/**
+ * @param sa persistent arena
+ * @param root pointer to store in the arena's file
+ * @return zero if the operation is successful
+ */
+int sicm_arena_set_root(sicm_arena sa, void *root);
+
+/// Write a file-backed arena's memory back to its file
+/**
+ * @param sa arena created by sicm_arena_open_persistent or
+ *        sicm_arena_create_mmapped
+ * @return zero if the operation is successful
+ */
+int sicm_arena_sync(sicm_arena sa);
+
+/// Create new arena that spills over to other devices
+/**
+ * @param maxsize maximum size of the arena's extents on devs, 0 is unlimited
+ * @param flags arena flags
+ * @param devs devices that will be used for the arena's allocations
+ * @param fallback devices that the arena's extents spill over to, in order
+ * @return handle to the newly created arena, or ARENA_DEFAULT if the
+ *         the function failed.
+ *
+ * Instead of failing allocations once maxsize is reached, the arena puts
+ * new extents on the first fallback device with enough free memory for
+ * them, or on the last one. The fallback devices must have the same page
+ * size as devs. Spilled extents stay on their fallback device when the
+ * arena is moved. sicm_arena_spilled reports how much of the arena
+ * spilled.
+ */
+sicm_arena sicm_arena_create_spill(size_t maxsize, sicm_arena_flags flags, sicm_device_list *devs,
+					sicm_device_list *fallback);
+
 /// Free up arena
 /**
  * @param handle to an arena you want to destroy
@@ -216,6 +479,55 @@ void sicm_arena_set_default(sicm_arena sa);
  */
 sicm_arena sicm_arena_get_default(void);
 
+/// Create an arena for each NUMA node
+/**
+ * @param maxsize maximum size of each arena
+ * @param flags arena flags
+ * @param devs devices to choose from, normally the list returned by sicm_init
+ * @param type kind of memory, e.g. SICM_DRAM or SICM_KNL_HBM
+ * @param page_size page size of the devices in KiB
+ * @return handle to the arenas, or NULL if the function failed or there is
+ *         no device of the given kind
+ *
+ * Each NUMA node is assigned the device of the given kind that is closest
+ * to it (by numa_distance). Nodes that share their closest device share
+ * its arena.
+ */
+sicm_numa_arenas *sicm_numa_arenas_create(size_t maxsize, sicm_arena_flags flags, sicm_device_list *devs,
+					sicm_device_tag type, int page_size);
+
+/// Destroy the arenas created by sicm_numa_arenas_create
+/**
+ * @param na arenas, including the memory allocated from them
+ */
+void sicm_numa_arenas_destroy(sicm_numa_arenas *na);
+
+/// Get the arena of a NUMA node
+/**
+ * @param na arenas
+ * @param node NUMA node
+ * @return the arena used for the node, or NULL if there is none
+ */
+sicm_arena sicm_numa_arenas_node(sicm_numa_arenas *na, int node);
+
+/// Get the arena of the node the calling thread runs on
+/**
+ * @param na arenas
+ * @return the arena of the current CPU's node
+ *
+ * The node is looked up in a CPU to node table built at initialization,
+ * so the call costs little more than sched_getcpu.
+ */
+sicm_arena sicm_numa_arenas_local(sicm_numa_arenas *na);
+
+/// Make sicm_alloc use the local arena of a set for the current thread
+/**
+ * @param na arenas, or NULL to stop using them
+ *
+ * A default arena set with sicm_arena_set_default takes precedence.
+ */
+void sicm_numa_arenas_set_default(sicm_numa_arenas *na);
+
 /// Get the list of devices that are being used for the arena's allocations
 /**
  * @param sa arena
@@ -228,9 +540,135 @@ sicm_device_list sicm_arena_get_devices(sicm_arena sa);
  * @param sa arena
  * @param devs list of devices assigned to the arena
  * @return zero if the operation is successful
+ *
+ * The devices may have a different page size than the current ones. The
+ * existing extents keep their page size and are only moved to the new
+ * nodes, the new page size is used for the extents allocated afterwards.
  */
 int sicm_arena_set_devices(sicm_arena sa, sicm_device_list *devs);
 
+/// Set the weights of the devices of a SICM_ALLOC_WEIGHTED arena
+/**
+ * @param sa arena
+ * @param weights one weight for each device of the arena, in the order of
+ *        sicm_arena_get_devices; weights of devices on the same NUMA node
+ *        add up
+ * @return zero if the operation is successful
+ *
+ * Out of every sum-of-weights stripes of the arena, each device gets as
+ * many as its weight, e.g. 3 and 1 put three quarters of the pages on the
+ * first device. The existing extents are moved. The weights are reset to
+ * 1 when the arena's devices change.
+ *
+ * Each run of stripes on one device is a separate kernel mapping. Stripes
+ * are a transparent huge page (or a huge page, if bigger) for small
+ * extents, and grow with the extent so that it spans at most 512 runs.
+ * Once an arena's extents are split into about 16384 more mappings than
+ * there are extents, new extents go to a single device each, picked by the
+ * weights, instead.
+ */
+int sicm_arena_set_weights(sicm_arena sa, unsigned *weights);
+
+/// Move part of an arena to other devices
+/**
+ * @param sa arena
+ * @param start start of the range, rounded down to the arena's page size
+ * @param len length of the range, rounded up to the arena's page size
+ * @param devs devices to move the range to, or NULL to give it the arena's
+ *        placement again
+ * @return zero if the operation is successful, -EBUSY if the arena is
+ *         being moved by sicm_arena_migrate_start
+ *
+ * The range must be within the arena's memory. It keeps its devices until
+ * the memory is returned to the system: sicm_arena_set_devices, a
+ * migration or the reuse of its pages by jemalloc don't move it back, and
+ * leave its pages alone. Within the range, SICM_ALLOC_WEIGHTED and
+ * SICM_ALLOC_ORDERED arenas behave like SICM_ALLOC_RELAXED ones.
+ */
+int sicm_arena_move_range(sicm_arena sa, void *start, size_t len, sicm_device_list *devs);
+
+/// Get how much of an arena was moved to a device
+/**
+ * @param sa arena
+ * @param dev device
+ * @return bytes of the ranges moved with sicm_arena_move_range that are
+ *         on dev's NUMA node
+ *
+ * A range moved to several devices is counted as interleaved over their
+ * nodes page by page. The count follows the ranges as their memory is
+ * returned to the system or moved again. The other size figures of the
+ * arena, sicm_arena_size, sicm_arena_spilled and the maxsize limit, still
+ * count the ranges at the devices of the extents they are in.
+ */
+size_t sicm_arena_moved_size(sicm_arena sa, sicm_device *dev);
+
+/// Start moving the arena to a new list of devices in the background
+/**
+ * @param sa arena
+ * @param devs list of devices assigned to the arena
+ * @param nthreads number of worker threads moving the pages, 0 picks
+ *        the number of online CPUs
+ * @param[out] m handle of the migration
+ * @return zero if the migration was started, -EBUSY if the arena is
+ *         already being moved, -ENOMEM if the devices don't have enough
+ *         free memory for the arena
+ *
+ * Unlike sicm_arena_set_devices, the function returns right away. New
+ * extents of the arena are allocated on the new devices from now on,
+ * while the workers move the existing ones with move_pages in batches.
+ * The arena can be used as usual during the migration, but its memory
+ * isn't returned to the system until the migration is done. There is no
+ * rollback: pages that couldn't be moved stay where they are and are
+ * reported by sicm_migration_failures.
+ *
+ * The pages that have to move are the resident ones on NUMA nodes outside
+ * of the new devices, apart from spilled extents and ranges moved with
+ * sicm_arena_move_range. The migration fails with -ENOMEM if they don't
+ * fit into the free memory of the new devices, as last seen by
+ * sicm_avail. The handle must be released with sicm_migration_free.
+ */
+int sicm_arena_migrate_start(sicm_arena sa, sicm_device_list *devs, int nthreads, sicm_migration **m);
+
+/// Get the progress of a migration
+/**
+ * @param m migration
+ * @param[out] st progress of the migration, can be NULL
+ * @return nonzero if the migration is done
+ */
+int sicm_migration_poll(sicm_migration *m, sicm_migration_status *st);
+
+/// Wait until a migration is done
+/**
+ * @param m migration
+ * @param[out] st final state of the migration, can be NULL
+ * @return zero if all pages were moved, first error otherwise
+ */
+int sicm_migration_wait(sicm_migration *m, sicm_migration_status *st);
+
+/// Stop a migration
+/**
+ * @param m migration
+ *
+ * The workers stop after their current batch. The arena keeps using the
+ * new devices for new extents; start another migration to move it back.
+ */
+void sicm_migration_cancel(sicm_migration *m);
+
+/// Get the ranges that a migration couldn't move
+/**
+ * @param m migration
+ * @param[out] f array that receives the failed ranges
+ * @param n size of the f array
+ * @return total number of failed ranges, can be bigger than n
+ */
+size_t sicm_migration_failures(sicm_migration *m, sicm_migration_failure *f, size_t n);
+
+/// Wait for a migration and free its handle
+/**
+ * @param m migration
+ */
+void sicm_migration_free(sicm_migration *m);
+
 /// Get arena size
 /**
  * @param sa arena
@@ -242,6 +680,96 @@ int sicm_arena_set_devices(sicm_arena sa, sicm_device_list *devs);
  */
 size_t sicm_arena_size(sicm_arena sa);
 
+/// Get the usage and placement statistics of an arena
+/**
+ * @param sa arena
+ * @param[out] st jemalloc's statistics for the arena, can be NULL
+ * @param[out] sizes sizes[n] receives the resident bytes of the arena's
+ *             extents on NUMA node n, can be NULL if nnodes is 0
+ * @param nnodes number of elements of sizes
+ * @return zero if the operation is successful
+ *
+ * st requires jemalloc to be built with statistics. The per-node sizes are
+ * queried with move_pages in batches of 1024 pages, so their cost grows
+ * with the arena's size rather than with the number of allocations.
+ * Pages that were never touched or were purged aren't counted.
+ */
+int sicm_arena_stats(sicm_arena sa, sicm_arena_statistics *st, size_t *sizes, int nnodes);
+
+/// Get how much of an arena spilled over to its fallback devices
+/**
+ * @param sa arena
+ * @param[out] sizes sizes[0] receives the size of the arena's extents on
+ *             its devices, sizes[i] the size of the ones on the i-th
+ *             fallback device (see sicm_arena_create_spill)
+ * @param n number of elements of sizes, can be 0
+ * @param[out] peak the most that was ever spilled, can be NULL
+ * @return size of the extents on all fallback devices
+ */
+size_t sicm_arena_spilled(sicm_arena sa, size_t *sizes, size_t n, size_t *peak);
+
+/// Set how much released memory the arena keeps for reuse
+/**
+ * @param sa arena
+ * @param max maximum size of the extents kept by the arena, in bytes
+ * @return zero if the operation is successful
+ *
+ * Extents that jemalloc gives back to the arena stay mapped and bound to
+ * the arena's devices, up to max bytes, and are reused before new ones
+ * are mapped. The default is 64 MiB, 0 unmaps released extents right
+ * away. The cached extents are included in sicm_arena_size.
+ */
+int sicm_arena_set_cache(sicm_arena sa, size_t max);
+
+/// Set how the arena faults in new memory
+/**
+ * @param sa arena
+ * @param mode populate mode
+ * @param nthreads number of threads for SICM_POPULATE_PARALLEL (at most
+ *        64); 0 uses one per CPU of the arena's first node
+ * @return zero if the operation is successful
+ *
+ * Extents are faulted in after they are bound to the arena's devices and
+ * without holding the arena's lock. With SICM_POPULATE_PARALLEL, extents
+ * of 64 MiB or more are split between threads that run on the arena's
+ * nodes in turn, smaller ones are faulted in like with
+ * SICM_POPULATE_EAGER. Arenas backed by a file are never populated. If
+ * the devices don't have the memory to fault an extent in, the extent is
+ * unmapped and the allocation fails.
+ */
+int sicm_arena_set_populate(sicm_arena sa, sicm_populate_mode mode, int nthreads);
+
+/// Set how fast the arena returns unused memory to the system
+/**
+ * @param sa arena
+ * @param dirty_ms time in milliseconds after which unused dirty pages are
+ *        lazily purged (MADV_FREE); 0 purges immediately, -1 never purges
+ * @param muzzy_ms time in milliseconds after which lazily purged pages are
+ *        released for good (MADV_DONTNEED); 0 and -1 as above
+ * @return zero if the operation is successful
+ *
+ * Purged pages stay mapped with the arena's memory policy, so they are
+ * faulted in on the arena's devices when they are reused. Arenas backed by
+ * a file (sicm_arena_create_mmapped) don't purge.
+ */
+int sicm_arena_set_decay(sicm_arena sa, ssize_t dirty_ms, ssize_t muzzy_ms);
+
+/// Get the decay times of an arena
+/**
+ * @param sa arena
+ * @param[out] dirty_ms dirty page decay time in milliseconds
+ * @param[out] muzzy_ms muzzy page decay time in milliseconds
+ * @return zero if the operation is successful
+ */
+int sicm_arena_get_decay(sicm_arena sa, ssize_t *dirty_ms, ssize_t *muzzy_ms);
+
+/// Return all of the arena's unused memory to the system right away
+/**
+ * @param sa arena
+ * @return zero if the operation is successful
+ */
+int sicm_arena_purge(sicm_arena sa);
+
 /// Allocate memory region
 /**
  * @param sa arena that should be used for the allocation. ARENA_DEFAULT is allowed.
@@ -272,13 +800,30 @@ void *sicm_arena_alloc_aligned(sicm_arena sa, size_t sz, size_t align);
  */
 void *sicm_arena_realloc(sicm_arena sa, void *ptr, size_t sz);
 
+/// Allocate a batch of same-sized memory regions
+/**
+ * @param sa arena that should be used for the allocations. ARENA_DEFAULT is allowed.
+ * @param sz size of each region
+ * @param n number of regions
+ * @param[out] ptrs array of n elements that receives the regions
+ * @return number of regions allocated, less than n if the arena ran out of
+ *         memory
+ *
+ * With jemalloc 5.3 or later, the regions are taken from the arena's bins
+ * in one pass (see experimental.batch_alloc), otherwise the function is
+ * equivalent to calling sicm_arena_alloc n times. The regions can be
+ * freed individually or with sicm_free_batch.
+ */
+size_t sicm_arena_alloc_batch(sicm_arena sa, size_t sz, size_t n, void **ptrs);
+
 /// Allocate memory region
 /**
  * @param sz size of the region
  * @return pointer to the new allocation, or NULL if the operation failed.
  *
- * The function uses the default arena, if set. Otherwise it uses the standard
- * (je_)malloc function.
+ * The function uses the default arena, if set, or the local arena of the
+ * default NUMA arenas (see sicm_numa_arenas_set_default). Otherwise it uses
+ * the standard (je_)malloc function.
  */
 void *sicm_alloc(size_t sz);
 
@@ -288,8 +833,9 @@ void *sicm_alloc(size_t sz);
  * @param align the alignment of the address; must be a power of 2
  * @return pointer to the new allocation, or NULL if the operation failed.
  *
- * The function uses the default arena, if set. Otherwise it uses the standard
- * (je_)malloc function.
+ * The function uses the default arena, if set, or the local arena of the
+ * default NUMA arenas (see sicm_numa_arenas_set_default). Otherwise it uses
+ * the standard (je_)malloc function.
  */
 void *sicm_alloc_aligned(size_t sz, size_t align);
 
@@ -299,6 +845,39 @@ void *sicm_alloc_aligned(size_t sz, size_t align);
  */
 void sicm_free(void *ptr);
 
+/// Deallocate memory region of a known size
+/**
+ * @param ptr pointer to the memory to deallocate
+ * @param sz size that the region was allocated with, 0 if unknown
+ *
+ * Equivalent to sicm_free, but jemalloc doesn't have to look up the size
+ * of the region.
+ */
+void sicm_free_sized(void *ptr, size_t sz);
+
+/// Deallocate memory region of a known arena and size
+/**
+ * @param sa arena that the region was allocated from. ARENA_DEFAULT is
+ *           allowed for memory from sicm_alloc without a default arena.
+ * @param ptr pointer to the memory to deallocate
+ * @param sz size that the region was allocated with, 0 if unknown
+ *
+ * Unlike sicm_free, the function doesn't look up which arena the region
+ * belongs to. Passing the wrong arena is undefined behavior.
+ */
+void sicm_arena_free(sicm_arena sa, void *ptr, size_t sz);
+
+/// Deallocate a batch of memory regions
+/**
+ * @param ptrs pointers to the memory to deallocate, NULL entries are skipped
+ * @param n number of pointers
+ *
+ * The arena of each region is only looked up when it isn't in the same
+ * extent as the previous one, so freeing regions allocated together is
+ * cheaper than calling sicm_free for each of them.
+ */
+void sicm_free_batch(void **ptrs, size_t n);
+
 /// Resize a memory region
 /**
  * @param ptr pointer to the memory to be resized
@@ -318,15 +897,81 @@ sicm_arena sicm_arena_lookup(void *ptr);
 /**
  * @param[in] device Pointer to a sicm_device to allocate on.
  * @param[in] size Amount of memory to allocate.
- * @return Pointer to the start of the allocation.
+ * @return Pointer to the start of the allocation, or NULL on failure.
  *
  * If you allocate on huge pages, your allocation will be rounded up to
- * a multiple of the huge page size. Also, if you try to allocate on
- * huge pages and there aren't enough huge pages available, the
- * allocation will fail and return -1.
+ * a multiple of the huge page size. If there aren't enough huge pages
+ * available, the allocation falls back to transparent huge pages and
+ * then to normal pages; see sicm_device_alloc_backing.
  */
 void* sicm_device_alloc(struct sicm_device* device, size_t size);
 
+/// Allocate memory on a SICM device and report how it is backed.
+/**
+ * @param[in] device Pointer to a sicm_device to allocate on.
+ * @param[in] size Amount of memory to allocate.
+ * @param[out] backing Kind of pages backing the allocation (may be NULL).
+ * @return Pointer to the start of the allocation, or NULL on failure.
+ *
+ * For huge page devices, reserved hugetlb pages are tried first. If the
+ * node's pool is exhausted, the memory is mapped aligned to the huge
+ * page size and advised with MADV_HUGEPAGE so the kernel can back it
+ * with transparent huge pages; if that is not available either, normal
+ * pages are used. Either way the memory is bound to the device's node
+ * and can be released with sicm_device_free.
+ */
+void* sicm_device_alloc_backing(struct sicm_device* device, size_t size, sicm_backing* backing);
+
+/// Serve small device allocations from a per-device cache.
+/**
+ * @return 0 on success, or -ENOMEM.
+ *
+ * Once enabled, sicm_device_alloc and sicm_device_alloc_backing requests
+ * of at most 2 KiB are rounded up to a power-of-two size class and carved
+ * out of slabs taken from the device, and sicm_device_free puts them back
+ * in the cache instead of unmapping them. Each thread keeps a small
+ * magazine of objects per device and size class, so most of these calls
+ * neither lock nor make a system call. Larger requests, and devices with
+ * pages over 2 MiB, are still mapped directly. For a cached allocation,
+ * sicm_device_alloc_backing reports the worst backing of any slab of its
+ * size class.
+ *
+ * sicm_device_free tells cached objects apart by their address, so memory
+ * allocated before the cache was enabled, or with
+ * sicm_device_alloc_mmapped or sicm_alloc_exact, is unmapped as before.
+ * Cached objects share pages, so don't sicm_move them. Setting the
+ * SICM_DEVICE_CACHE environment variable to a nonzero value enables
+ * the cache in sicm_init.
+ */
+int sicm_device_cache_enable(void);
+
+/// Get the firmware-reported performance of a device.
+/**
+ * @param[in] device Pointer to a sicm_device.
+ * @param[in] access Class of initiators the attributes apply to.
+ * @param[out] perf Bandwidths and latencies of the device.
+ * @return 0 on success, -ENODATA if the platform reports no attributes
+ * for the device, or -EINVAL.
+ *
+ * The attributes come from the kernel's view of the ACPI HMAT and are
+ * read once by sicm_init. They describe the device as seen from its
+ * nearest initiator of the given class, and are also available for
+ * CXL-attached memory. Attributes the platform didn't report are 0.
+ */
+int sicm_device_get_perf(struct sicm_device* device, sicm_access_class access, sicm_device_perf* perf);
+
+/// Number of allocations on a device that got the given backing.
+/**
+ * @param[in] device Pointer to a sicm_device.
+ * @param[in] backing Kind of backing to count.
+ * @return Number of sicm_device_alloc calls served with that backing.
+ * Allocations served from the device cache are counted once per slab.
+ *
+ * On huge page devices, nonzero SICM_BACKING_THP and SICM_BACKING_NORMAL
+ * counts show how often the hugetlb pool ran dry.
+ */
+size_t sicm_device_backing_count(struct sicm_device* device, sicm_backing backing);
+
 /// Returns whether the device supports exact placement.
 /**
  * @param[in] device Pointer to a sicm_device to query.
@@ -411,20 +1056,35 @@ int sicm_pin(sicm_device* device);
 /// Query capacity of a device a device.
 /**
  * @param[in] device Pointer to the sicm_device to query.
- * @return Capacity in kibibytes on the device.
+ * @return Capacity in kibibytes on the device, or -1 on error.
+ *
+ * Like sicm_avail, this returns a cached value; see
+ * sicm_capacity_refresh_interval.
  */
 size_t sicm_capacity(sicm_device* device);
 
 /// Query amount of available memory on a device.
 /**
  * @param[in] device Pointer to the sicm_device to query.
- * @return Number of available kibibytes on the device.
+ * @return Number of available kibibytes on the device, or -1 on error.
  *
  * Note that this does not account for memory that has been allocated
- * but not yet touched.
+ * but not yet touched. The value is a snapshot that is re-read from
+ * sysfs at most once per refresh interval, so frequent calls are cheap.
  */
 size_t sicm_avail(sicm_device* device);
 
+/// Set how old sicm_capacity and sicm_avail results may get.
+/**
+ * @param[in] usec Refresh interval in microseconds (10000 by default).
+ * 0 makes every call read sysfs.
+ *
+ * When a snapshot is older than the interval, the first caller to
+ * notice re-reads it; other callers meanwhile get the previous values
+ * without locking.
+ */
+void sicm_capacity_refresh_interval(unsigned int usec);
+
 /// Returns a distance metric based on general beliefs about the device/its location in the system.
 /**
  * @param[in] device Pointer to the sicm_device to query.
@@ -468,6 +1128,44 @@ int sicm_is_near(sicm_device* device);
  */
 void sicm_latency(sicm_device* device, size_t size, int iter, struct sicm_timing* res);
 
+/// Measure the load-to-use latency of a device by pointer chasing.
+/**
+ * @param[in] device Pointer to the sicm_device to measure.
+ * @param[in] initiator NUMA node to run the measurement on, or -1 to
+ * stay on the current CPUs.
+ * @param[in] size Size of the buffer; make it well beyond the last-level
+ * cache to measure memory rather than cache.
+ * @param[in] iter Number of dependent loads to time.
+ * @return Average nanoseconds per load, or -1 on failure.
+ *
+ * Unlike sicm_latency, each load reads the address of the next one, so
+ * the loads can't overlap or be optimized away. The cache lines of the
+ * buffer are linked into a single random cycle, which defeats the
+ * prefetchers. Huge page devices get huge pages through
+ * sicm_device_alloc_backing, and normal page buffers are advised for
+ * transparent huge pages, to keep TLB misses out of the result. The
+ * calling thread's CPU affinity is restored afterwards.
+ */
+double sicm_latency_chase(sicm_device* device, int initiator, size_t size, size_t iter);
+
+/// Measure or load the latency of every device from every initiator node.
+/**
+ * @param[in] devs Devices to measure.
+ * @param[in] size Buffer size for sicm_latency_chase.
+ * @param[in] iter Number of loads for sicm_latency_chase.
+ * @param[in] cache Path of a results file, or NULL.
+ * @param[out] matrix Array of (numa_max_node() + 1) * devs->count
+ * latencies in nanoseconds, indexed [initiator * devs->count + device].
+ * @return 0 on success, or -EINVAL.
+ *
+ * If the cache file has a result for every pair, the matrix is loaded
+ * from it without measuring. Otherwise every pair is measured with
+ * sicm_latency_chase and the file is rewritten. The file is plain text
+ * with one "initiator node page_size latency" line per pair, so job
+ * launchers can read it as well. Initiators without CPUs get -1.
+ */
+int sicm_latency_matrix(sicm_device_list* devs, size_t size, size_t iter, const char* cache, double* matrix);
+
 /// Measure empirical bandwidth, using linear access on a kernel function of arity 2.
 /**
  * @param[in] device Pointer to the sicm_device to query.
@@ -548,6 +1246,30 @@ size_t sicm_bandwidth_linear3(sicm_device* device, size_t size,
 size_t sicm_bandwidth_random3(sicm_device* device, size_t size,
   size_t (*kernel)(double* a, double* b, double* c, size_t* indexes, size_t size));
 
+/// Measure STREAM-like bandwidth of a device from an initiator node.
+/**
+ * @param[in] device Pointer to the sicm_device to measure.
+ * @param[in] initiator NUMA node whose CPUs run the kernel, or -1 to
+ * run wherever the threads are scheduled.
+ * @param[in] kernel Kernel to run.
+ * @param[in] size Number of doubles in each array.
+ * @param[in] reps Number of timed repetitions.
+ * @param[in] nthreads Number of threads, or 0 for one per CPU of the
+ * initiator node.
+ * @param[in] flags SICM_BW_NONTEMPORAL and/or SICM_BW_NOVECTOR.
+ * @param[out] res Best, median and standard deviation of the bandwidth.
+ * @return 0 on success, -EINVAL, -ENOMEM or -EAGAIN.
+ *
+ * Three arrays are allocated on the device. Each thread is pinned to the
+ * initiator node, first touches its own chunk, and runs the kernel on
+ * that chunk in every repetition, between barriers. The kernels use
+ * AVX-512 or AVX2 if the CPU supports them. Bandwidth counts the bytes
+ * of the arrays the kernel names, like STREAM does, and the first,
+ * untimed repetition warms up caches and TLBs.
+ */
+int sicm_bandwidth(sicm_device* device, int initiator, sicm_bw_kernel kernel, size_t size,
+    int reps, int nthreads, int flags, sicm_bw_result* res);
+
 /// Linear-access triad kernel for use with sicm_bandwidth_linear3.
 /**
  * This is modeled after the STREAM benchmark: for all indexes, computes
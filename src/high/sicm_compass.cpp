@@ -117,6 +117,8 @@ struct compass : public ModulePass {
         allocFnMap["_Znwm"] = "sh_alloc";
         dallocFnMap["_ZdaPv"] = "sh_free";
         dallocFnMap["_ZdlPv"] = "sh_free";
+        dallocFnMap["_ZdaPvm"] = "sh_free_sized";
+        dallocFnMap["_ZdlPvm"] = "sh_free_sized";
 
 	/* Fortran */
         allocFnMap["f90_alloc"] = "f90_sh_alloc";
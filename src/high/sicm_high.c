@@ -45,7 +45,6 @@ int should_run_rdspy;
 /* Keep track of all extents */
 extent_arr *extents;
 extent_arr *rss_extents; /* The extents that we want to get the RSS of */
-pthread_rwlock_t extents_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 /* Keeps track of arenas */
 arena_info **arenas;
@@ -117,25 +116,10 @@ char *layout_str(enum arena_layout layout) {
 
 /* Gets the SICM low-level device that corresponds to a NUMA node ID */
 sicm_device *get_device_from_numa_node(int id) {
-  struct sicm_device *retval, *device;
-  int i;
+  struct sicm_device *retval;
 
-  retval = NULL;
-  /* Figure out which device the NUMA node corresponds to */
-  device = device_list.devices;
-  for(i = 0; i < device_list.count; i++) {
-    /* If the device has a NUMA node, and if that node is the node we're
-     * looking for.
-     */
-    if((device->tag == SICM_DRAM ||
-       device->tag == SICM_KNL_HBM || 
-       device->tag == SICM_POWERPC_HBM) &&
-       sicm_numa_id(device) == id) {
-      retval = device;
-      break;
-    }
-    device++;
-  }
+  /* The normal-page device of the node, whatever its type */
+  retval = sicm_node_device(id, 0);
   /* If we don't find an appropriate device, it stays NULL
    * so that no allocation sites will be bound to it
    */
@@ -550,15 +534,7 @@ void sh_create_extent(void *start, void *end) {
     extent_arr_insert(rss_extents, start, end, arenas[arena_index]);
   }
 
-  if(pthread_rwlock_wrlock(&extents_lock) != 0) {
-    fprintf(stderr, "Failed to acquire read/write lock. Aborting.\n");
-    exit(1);
-  }
   extent_arr_insert(extents, start, end, arenas[arena_index]);
-  if(pthread_rwlock_unlock(&extents_lock) != 0) {
-    fprintf(stderr, "Failed to unlock read/write lock. Aborting.\n");
-    exit(1);
-  }
 }
 
 /* Gets the device that this site should go onto from the site_nodes tree */
@@ -719,13 +695,24 @@ void sh_free(void* ptr) {
   }
 }
 
+/* Sized C++ deletes, which know the size of the allocation */
+void sh_free_sized(void* ptr, size_t sz) {
+  if (should_run_rdspy) {
+      sh_rdspy_free(ptr);
+  }
+
+  if(layout == INVALID_LAYOUT) {
+    je_free(ptr);
+  } else {
+    sicm_free_sized(ptr, sz);
+  }
+}
+
 __attribute__((constructor))
 void sh_init() {
   int i;
   long size;
 
-  //pthread_rwlock_init(&extents_lock, NULL);
-
   device_list = sicm_init();
 
   /* Get the number of NUMA nodes with memory, since we ignore huge pages with
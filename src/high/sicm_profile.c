@@ -251,6 +251,7 @@ static void
 get_accesses() {
   uint64_t head, tail, buf_size;
   arena_info *arena;
+  extent_info extent;
   void *addr;
   char *base, *begin, *end, break_next_site;
   size_t i, packed_size, total_value;
@@ -287,7 +288,6 @@ get_accesses() {
   end = base + head % buf_size;
 
   /* Read all of the samples */
-  pthread_rwlock_rdlock(&extents_lock);
   while(begin != end) {
 
     header = (struct perf_event_header *)begin;
@@ -299,13 +299,10 @@ get_accesses() {
 
     if(addr) {
       prof.total++;
-      /* Search for which extent it goes into */
-      extent_arr_for(extents, i) {
-        if(!extents->arr[i].start && !extents->arr[i].end) continue;
-        arena = extents->arr[i].arena;
-        if((addr >= extents->arr[i].start) && (addr <= extents->arr[i].end)) {
-          arena->accesses++;
-        }
+      /* Find the extent that it goes into */
+      if(extent_arr_lookup(extents, addr, &extent)) {
+        arena = extent.arena;
+        arena->accesses++;
       }
     }
 
@@ -316,7 +313,6 @@ get_accesses() {
       begin = begin + header->size;
     }
   }
-  pthread_rwlock_unlock(&extents_lock);
 
   /* Let perf know that we've read this far */
   prof.metadata->data_tail = head;
@@ -425,22 +421,23 @@ get_rss() {
 	size_t i, n, numpages;
   uint64_t start, end;
   arena_info *arena;
+  extent_leaf *l;
   ssize_t num_read;
 
-  /* Grab the lock for the extents array */
-  pthread_rwlock_rdlock(&extents_lock);
+  /* Keep the extents from changing while we iterate over them */
+  extent_arr_lock(rss_extents);
 
 	/* Zero out the RSS values for each arena */
-	extent_arr_for(rss_extents, i) {
-    arena = rss_extents->arr[i].arena;
+	extent_arr_for(rss_extents, l, i) {
+    arena = l->ext[i].arena;
 		arena->rss = 0;
 	}
 
 	/* Iterate over the chunks */
-	extent_arr_for(rss_extents, i) {
-		start = (uint64_t) rss_extents->arr[i].start;
-		end = (uint64_t) rss_extents->arr[i].end;
-		arena = rss_extents->arr[i].arena;
+	extent_arr_for(rss_extents, l, i) {
+		start = (uint64_t) l->ext[i].start;
+		end = (uint64_t) l->ext[i].end;
+		arena = l->ext[i].arena;
 
     numpages = (end - start) /prof.pagesize;
 		prof.pfndata = (union pfn_t *) realloc(prof.pfndata, numpages * prof.addrsize);
@@ -471,7 +468,7 @@ get_rss() {
 			arena->peak_rss = arena->rss;
 		}
 	}
-  pthread_rwlock_unlock(&extents_lock);
+  extent_arr_unlock(rss_extents);
 }
 
 void *profile_rss(void *a) {
@@ -1,35 +1,346 @@
+#define _GNU_SOURCE	// fallocate
+
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <numa.h>
 #include <numaif.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #include "sicm_low.h"
 #include "sicm_impl.h"
 
+/* A thread's explicit tcache for one arena */
+typedef struct sa_tcache {
+	unsigned long	serial;		// serial of the arena it was created for, 0 if unused
+	unsigned	gen;		// arena's tcache_gen when the tcache was last flushed
+	unsigned	ind;		// jemalloc tcache index
+} sa_tcache;
+
+/* All explicit tcaches of a thread, indexed by jemalloc arena index */
+typedef struct sa_tcache_list {
+	unsigned	count;
+	sa_tcache*	tcaches;
+} sa_tcache_list;
+
+#ifndef MPOL_PREFERRED_MANY
+#define MPOL_PREFERRED_MANY 5
+#endif
+
+// older kernels ignore it and treat the address as a hint
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/* Copy of an arena's placement policy that can be used without its mutex */
+typedef struct sa_policy {
+	int		mpol;
+	unsigned long*	mask;		// sa_mask_longs words
+	unsigned long	maxnode;
+	sarena_nodes	nodes;
+} sa_policy;
+
+/* Part of an extent faulted in by one thread, see sa_populate */
+typedef struct sa_populate_work {
+	char*		start;
+	size_t		size;
+	size_t		pgsz;
+	int		node;		// node to run on
+	int		err;		// result of sa_populate_range
+} sa_populate_work;
+
+// SICM_POPULATE_PARALLEL only splits up extents of at least this size
+#define SA_POPULATE_PARALLEL_MIN (64UL << 20)
+#define SA_POPULATE_MAX_THREADS 64
+
+/* Range of an arena with its own placement, see sicm_arena_move_range */
+struct sa_override {
+	void*		start;
+	void*		end;
+	sa_policy	pol;		// mask is owned by the override
+};
+
+/* A range of pages to migrate */
+typedef struct sa_range {
+	void*		start;
+	void*		end;
+	size_t		pgsz;		// page size of the mapping
+	int		node;		// node of SICM_ALLOC_ORDERED and spilled ranges
+	unsigned	shift;		// SICM_ALLOC_WEIGHTED stripe size, see sa_weighted_shift
+} sa_range;
+
+/* State of an asynchronous migration started by sicm_arena_migrate_start.
+ * The workers take batches of pages from the snapshot of the arena's extents
+ * under the mutex, and move them without holding any of the arena's locks.
+ */
+struct sicm_migration {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;		// signalled when done is set
+	sarena*		sa;
+	unsigned	refs;		// caller, workers, sicm_arena_destroy
+	unsigned	workers;	// workers still running
+
+	sa_policy	pol;		// new policy of the arena
+
+	sa_range*	ranges;		// extents at the time the migration started
+	size_t		nranges;
+	size_t		cur;		// range of the next batch
+	size_t		off;		// offset of the next batch within the range
+
+	sicm_migration_failure* failures;
+	size_t		nfailures, maxfailures;
+	size_t		total, moved, failed;
+	int		err;
+	int		done;
+	int		cancelled;
+};
+
+/* One arena per memory device, and the one to use for each NUMA node */
+struct sicm_numa_arenas {
+	sicm_arena*	arenas;
+	unsigned	narenas;
+	sicm_arena*	bynode;		// numa_max_node() + 1 entries
+	int		nnodes;
+};
+
+/* Arenas by jemalloc arena index: SA_TABLE_SIZE lazily allocated chunks of
+ * SA_TABLE_SIZE entries each, enough for jemalloc's maximum number of arenas.
+ * Updated under sa_mutex, read without locking.
+ */
+#define SA_TABLE_BITS 10
+#define SA_TABLE_SIZE (1 << SA_TABLE_BITS)
+
 static pthread_mutex_t sa_mutex = PTHREAD_MUTEX_INITIALIZER;
 static int sa_num;
+static unsigned long sa_serial;
 static sarena *sa_list;
+static sarena *sa_pool;		// destroyed arenas kept for sicm_arena_create
+static unsigned sa_npooled, sa_pool_max;
+static sarena **sa_table[SA_TABLE_SIZE];
+static extent_arr *sa_extents;	// extents of all arenas, for ptr -> arena lookups
+static size_t sa_mask_longs;	// size of the maskp array of a nodemask
+static size_t sa_page_size;	// normal page size in bytes
+static size_t sa_thp_size;	// transparent huge page size in bytes
 static size_t sa_lookup_mib[2];
+static size_t sa_batch_mib[2];	// experimental.batch_alloc, if jemalloc has it
+static size_t sa_batch_miblen;
 static pthread_once_t sa_init = PTHREAD_ONCE_INIT;
 static pthread_key_t sa_default_key;
+static pthread_key_t sa_tcache_key;
+static pthread_key_t sa_numa_key;	// sicm_numa_arenas used by sicm_alloc
+static int *sa_cpu_node;	// NUMA node of each CPU
+static int sa_ncpus;
 static extent_hooks_t sa_hooks;
 void (*sicm_extent_alloc_callback)(void *start, void *end) = NULL;
 
+static void sa_tcache_fini(void *);
+
 static void sarena_init() {
-	int err;
+	int i, err;
 	size_t miblen;
+	struct bitmask *nodemask;
+	FILE *f;
 
 	pthread_key_create(&sa_default_key, NULL);
+	pthread_key_create(&sa_tcache_key, sa_tcache_fini);
+	pthread_key_create(&sa_numa_key, NULL);
+	sa_extents = extent_arr_init();
+
+	nodemask = numa_allocate_nodemask();
+	sa_mask_longs = sicm_div_ceil(nodemask->size, 8 * sizeof(unsigned long));
+	numa_free_nodemask(nodemask);
+
+	// sched_getcpu is cheap, numa_node_of_cpu isn't
+	sa_ncpus = numa_num_configured_cpus();
+	sa_cpu_node = malloc(sa_ncpus * sizeof(int));
+	if (sa_cpu_node == NULL)
+		sa_ncpus = 0;
+	for(i = 0; i < sa_ncpus; i++)
+		sa_cpu_node[i] = numa_node_of_cpu(i);
+
+	sa_page_size = sysconf(_SC_PAGESIZE);
+	sa_thp_size = 2 * 1024 * 1024;
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%zu", &sa_thp_size) != 1)
+			sa_thp_size = 2 * 1024 * 1024;
+		fclose(f);
+	}
+
 	miblen = 2;
 	err = je_mallctlnametomib("arenas.lookup", sa_lookup_mib, &miblen);
 	if (err != 0)
 		fprintf(stderr, "can't get mib: %d\n", err);
+
+	// only in jemalloc 5.3 and later, sicm_arena_alloc_batch falls back to
+	// mallocx without it
+	sa_batch_miblen = 2;
+	if (je_mallctlnametomib("experimental.batch_alloc", sa_batch_mib, &sa_batch_miblen) != 0)
+		sa_batch_miblen = 0;
+}
+
+// should be called with sa_mutex held
+static int sa_table_set(unsigned arena_ind, sarena *sa) {
+	sarena **chunk;
+
+	if ((arena_ind >> SA_TABLE_BITS) >= SA_TABLE_SIZE)
+		return -EINVAL;
+
+	chunk = sa_table[arena_ind >> SA_TABLE_BITS];
+	if (chunk == NULL) {
+		chunk = calloc(SA_TABLE_SIZE, sizeof(sarena *));
+		if (chunk == NULL)
+			return -ENOMEM;
+
+		__atomic_store_n(&sa_table[arena_ind >> SA_TABLE_BITS], chunk, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&chunk[arena_ind & (SA_TABLE_SIZE - 1)], sa, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static sarena *sa_find(unsigned arena_ind) {
+	sarena **chunk;
+
+	if ((arena_ind >> SA_TABLE_BITS) >= SA_TABLE_SIZE)
+		return NULL;
+
+	chunk = __atomic_load_n(&sa_table[arena_ind >> SA_TABLE_BITS], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return NULL;
+
+	return __atomic_load_n(&chunk[arena_ind & (SA_TABLE_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+
+// remember a tcache created for the arena, so that sicm_arena_destroy can get rid of it
+static int sa_tcache_register(sarena *sa, unsigned ind) {
+	unsigned *tcaches;
+	int ret;
+
+	ret = 0;
+	pthread_mutex_lock(sa->mutex);
+	if (sa->ntcaches == sa->maxtcaches) {
+		tcaches = realloc(sa->tcaches, 2 * (sa->maxtcaches + 1) * sizeof(unsigned));
+		if (tcaches == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		sa->tcaches = tcaches;
+		sa->maxtcaches = 2 * (sa->maxtcaches + 1);
+	}
+
+	sa->tcaches[sa->ntcaches++] = ind;
+
+out:
+	pthread_mutex_unlock(sa->mutex);
+	return ret;
+}
+
+// called on thread exit
+static void sa_tcache_fini(void *arg) {
+	sa_tcache_list *tl = arg;
+	sa_tcache *tc;
+	sarena *sa;
+	unsigned i;
+	size_t j;
+
+	pthread_mutex_lock(&sa_mutex);
+	for(i = 0; i < tl->count; i++) {
+		tc = &tl->tcaches[i];
+		if (tc->serial == 0)
+			continue;
+
+		// tcaches of destroyed arenas are already gone
+		sa = sa_find(i);
+		if (sa == NULL || sa->serial != tc->serial)
+			continue;
+
+		pthread_mutex_lock(sa->mutex);
+		for(j = 0; j < sa->ntcaches; j++) {
+			if (sa->tcaches[j] == tc->ind) {
+				sa->tcaches[j] = sa->tcaches[--sa->ntcaches];
+				break;
+			}
+		}
+		pthread_mutex_unlock(sa->mutex);
+
+		je_mallctl("tcache.destroy", NULL, NULL, (void *) &tc->ind, sizeof(unsigned));
+	}
+	pthread_mutex_unlock(&sa_mutex);
+
+	free(tl->tcaches);
+	free(tl);
+}
+
+// returns the tcache part of the mallocx flags for the calling thread
+static int sa_tcache_flags(sarena *sa) {
+	sa_tcache_list *tl;
+	sa_tcache *tc;
+	unsigned ind, gen, n;
+	size_t sz;
+
+	if (!(sa->flags & SICM_ALLOC_TCACHE))
+		return MALLOCX_TCACHE_NONE;
+
+	tl = pthread_getspecific(sa_tcache_key);
+	if (tl == NULL) {
+		tl = calloc(1, sizeof(sa_tcache_list));
+		if (tl == NULL)
+			return MALLOCX_TCACHE_NONE;
+
+		pthread_setspecific(sa_tcache_key, tl);
+	}
+
+	if (sa->arena_ind >= tl->count) {
+		n = tl->count ? tl->count : 16;
+		while (n <= sa->arena_ind)
+			n *= 2;
+
+		tc = realloc(tl->tcaches, n * sizeof(sa_tcache));
+		if (tc == NULL)
+			return MALLOCX_TCACHE_NONE;
+
+		memset(&tc[tl->count], 0, (n - tl->count) * sizeof(sa_tcache));
+		tl->tcaches = tc;
+		tl->count = n;
+	}
+
+	tc = &tl->tcaches[sa->arena_ind];
+	gen = __atomic_load_n(&sa->tcache_gen, __ATOMIC_ACQUIRE);
+	if (tc->serial != sa->serial) {
+		// first allocation from this arena, or the slot belonged to
+		// a destroyed arena that had the same index
+		sz = sizeof(unsigned);
+		if (je_mallctl("tcache.create", (void *) &ind, &sz, NULL, 0) != 0)
+			return MALLOCX_TCACHE_NONE;
+
+		if (sa_tcache_register(sa, ind) != 0) {
+			je_mallctl("tcache.destroy", NULL, NULL, (void *) &ind, sizeof(unsigned));
+			return MALLOCX_TCACHE_NONE;
+		}
+
+		tc->serial = sa->serial;
+		tc->gen = gen;
+		tc->ind = ind;
+	} else if (tc->gen != gen) {
+		// the arena was moved since we last used the tcache
+		je_mallctl("tcache.flush", NULL, NULL, (void *) &tc->ind, sizeof(unsigned));
+		tc->gen = gen;
+	}
+
+	return MALLOCX_TCACHE(tc->ind);
 }
 
 // check if all devices use NUMA and if they are have the same page size
@@ -64,6 +375,95 @@ error:
 	return NULL;
 }
 
+// memory policy of the arena's extents
+static int sa_mpol(sicm_arena_flags flags, unsigned nnodes) {
+	switch (flags & SICM_ALLOC_MASK) {
+	case SICM_ALLOC_STRICT:
+		return MPOL_BIND;
+
+	case SICM_ALLOC_RELAXED:
+		return nnodes > 1 ? MPOL_PREFERRED_MANY : MPOL_PREFERRED;
+
+	case SICM_ALLOC_INTERLEAVE:
+		return MPOL_INTERLEAVE;
+
+	case SICM_ALLOC_WEIGHTED:
+	case SICM_ALLOC_ORDERED:
+		// each stripe or extent prefers a single node (equal weights
+		// interleave), see sa_mbind
+		return MPOL_PREFERRED;
+
+	default:
+		return MPOL_DEFAULT;
+	}
+}
+
+// the distinct nodes of the devices, in list order, all with weight 1
+static void sa_nodes_init(sarena_nodes *n, sicm_device_list *devs) {
+	unsigned i, j;
+	int node;
+
+	n->count = 0;
+	for(i = 0; i < devs->count && n->count < SARENA_MAX_NODES; i++) {
+		node = sicm_numa_id(devs->devices[i]);
+		for(j = 0; j < n->count && n->node[j] != node; j++)
+			;
+
+		if (j == n->count) {
+			n->node[n->count] = node;
+			n->weight[n->count] = 1;
+			n->count++;
+		}
+	}
+	n->total = n->count;
+}
+
+static void sa_free(sarena *sa);
+static bool sa_unmap(sarena *, void *, size_t);
+static int sa_override_clear(sarena *, void *, void *);
+static int sa_node_sizes(sarena *, size_t *, int, int);
+
+// add the arena to the global list of arenas
+static int sa_link(sarena *sa) {
+	pthread_mutex_lock(&sa_mutex);
+	if (sa_table_set(sa->arena_ind, sa) != 0) {
+		pthread_mutex_unlock(&sa_mutex);
+		fprintf(stderr, "arena index out of range: %u\n", sa->arena_ind);
+		return -EINVAL;
+	}
+
+	sa->serial = ++sa_serial;
+	sa->next = sa_list;
+	sa_list = sa;
+	sa_num++;
+	pthread_mutex_unlock(&sa_mutex);
+
+	return 0;
+}
+
+// Remove the arena from the global list and get rid of the tcaches created
+// for it; jemalloc requires them to be flushed before the arena is
+// destroyed or reset.
+static void sa_unlink(sarena *sa) {
+	sarena **p;
+	size_t i;
+
+	pthread_mutex_lock(&sa_mutex);
+	for(p = &sa_list; *p != NULL; p = &(*p)->next) {
+		if (*p == sa) {
+			*p = sa->next;
+			sa_num--;
+			sa_table_set(sa->arena_ind, NULL);
+			break;
+		}
+	}
+
+	for(i = 0; i < sa->ntcaches; i++)
+		je_mallctl("tcache.destroy", NULL, NULL, (void *) &sa->tcaches[i], sizeof(unsigned));
+	sa->ntcaches = 0;
+	pthread_mutex_unlock(&sa_mutex);
+}
+
 static sarena *sicm_arena_new(size_t sz, sicm_arena_flags flags, sicm_device_list *devs, int fd, off_t offset, int mutexfd, off_t mutexoff) {
 	int err, cpgsz;
 	sarena *sa;
@@ -110,8 +510,37 @@ static sarena *sicm_arena_new(size_t sz, sicm_arena_flags flags, sicm_device_lis
 	sa->size = 0;
 	sa->maxsize = sz;
 	sa->nodemask = nodemask;
+	sa_nodes_init(&sa->nodes, devs);
+	sa->mpol = sa_mpol(flags, sa->nodes.count);
+	sa->pgsz = sicm_device_page_size(devs->devices[0]) * 1024L;
+	sa->policy_gen = 0;
 	sa->fd = -1;	// DON'T TOUCH! sa_alloc depends on it being -1 when arenas.create is called.
+	sa->file_off = 0;
+	sa->file_size = 0;
+	sa->persist = NULL;
 	sa->extents = extent_arr_init();
+	sa->huge_extents = extent_arr_init();
+	sa->fallback.count = 0;
+	sa->fallback.devices = NULL;
+	sa->fallback_size = NULL;
+	sa->spilled = 0;
+	sa->peak_spilled = 0;
+	sa->weighted_cuts = 0;
+	sa->ncached = 0;
+	sa->cached = 0;
+	sa->max_cached = SARENA_CACHE_DEFAULT;
+	sa->overrides = NULL;
+	sa->noverrides = 0;
+	sa->maxoverrides = 0;
+	sa->moved = NULL;
+	sa->populate = SICM_POPULATE_EAGER;
+	sa->populate_threads = 1;
+	pthread_rwlock_init(&sa->migrate_lock, NULL);
+	sa->migration = NULL;
+	sa->tcache_gen = 0;
+	sa->tcaches = NULL;
+	sa->ntcaches = 0;
+	sa->maxtcaches = 0;
 	sa->hooks = sa_hooks;
 	new_hooks = &sa->hooks;
 	arena_ind_sz = sizeof(unsigned); // sa->arena_ind);
@@ -120,6 +549,7 @@ static sarena *sicm_arena_new(size_t sz, sicm_arena_flags flags, sicm_device_lis
 	if (err != 0) {
 		fprintf(stderr, "can't create an arena: %d\n", err);
 		pthread_mutex_destroy(sa->mutex);
+		pthread_rwlock_destroy(&sa->migrate_lock);
 		munmap(sa->mutex, sizeof(pthread_mutex_t));
 		free(sa);
 		return NULL;
@@ -131,193 +561,1754 @@ static sarena *sicm_arena_new(size_t sz, sicm_arena_flags flags, sicm_device_lis
 	// The jemalloc code needs to allocate an extent or two for internal
 	// use and our extent allocation code checks if sa->fd is negative
 	// to decide whether to allocate private or shared region
-	sa->size = offset;	// FIXME: is this correct???
+	if (fd != -1) {
+		sa->file_off = offset;
+		sa->file_size = lseek(fd, 0, SEEK_END);
+	}
 	sa->fd = fd;
 
-	// add the arena to the global list of arenas
-	pthread_mutex_lock(&sa_mutex);
-	sa->next = sa_list;
-	sa_list = sa;
-	sa_num++;
-	pthread_mutex_unlock(&sa_mutex);
+	if (sa_link(sa) != 0) {
+		sa_free(sa);
+		return NULL;
+	}
 
 	return sa;
 }
 
-sicm_arena sicm_arena_create(size_t sz, sicm_arena_flags flags, sicm_device_list *devs) {
-	return sicm_arena_new(sz, flags, devs, -1, 0, -1, 0);
-}
+// Keep a destroyed arena for sicm_arena_create instead of giving its
+// jemalloc arena index back. Only arenas that sicm_arena_create could have
+// made qualify. The arena must already be unlinked.
+static int sa_pool_put(sarena *sa) {
+	char str[32];
+	size_t i;
+	int full;
 
-sicm_arena sicm_arena_create_mmapped(size_t sz, sicm_arena_flags flags, sicm_device_list *devs, int fd,
-						off_t offset, int mutex_fd, off_t mutex_offset) {
-	return sicm_arena_new(sz, flags, devs, fd, offset, mutex_fd, mutex_offset);
-}
+	if (sa->fd != -1 || sa->fallback.count > 0 || sa->pgsz != sa_page_size || sa->huge_extents->count > 0)
+		return 0;
 
-void sicm_arena_destroy(sicm_arena arena) {
-	sarena *sa = arena;
-	char str[32];
-	size_t arena_ind_sz;
+	pthread_mutex_lock(&sa_mutex);
+	full = sa_npooled >= sa_pool_max;
+	pthread_mutex_unlock(&sa_mutex);
+	if (full)
+		return 0;
 
-	if (sa == NULL)
-		return;
+	// drop all allocations and give the pages back; jemalloc keeps the
+	// extents as retained
+	snprintf(str, sizeof(str), "arena.%u.reset", sa->arena_ind);
+	if (je_mallctl(str, NULL, NULL, NULL, 0) != 0)
+		return 0;
 
-	/* Free up the arena */
-	snprintf(str, sizeof(str), "arena.%u.destroy", sa->arena_ind);
-	arena_ind_sz = sizeof(unsigned);
-	je_mallctl(str, (void *) &sa->arena_ind, &arena_ind_sz, NULL, 0);
+	snprintf(str, sizeof(str), "arena.%u.purge", sa->arena_ind);
+	je_mallctl(str, NULL, NULL, NULL, 0);
 
-	extent_arr_free(sa->extents);
-	munmap(sa->mutex, sizeof(pthread_mutex_t));
-	free(sa->devs.devices);
-	numa_free_nodemask(sa->nodemask);
-	free(sa);
-}
+	for(i = 0; i < sa->ncached; i++)
+		sa_unmap(sa, sa->cache[i].start, sa->cache[i].size);
+	sa->ncached = 0;
+	sa->cached = 0;
 
-sicm_arena_list *sicm_arenas_list() {
-	int i;
-	sicm_arena_list *l;
-	sarena *a;
+	pthread_mutex_lock(sa->mutex);
+	sa_override_clear(sa, NULL, (void *) UINTPTR_MAX);
+	pthread_mutex_unlock(sa->mutex);
 
 	pthread_mutex_lock(&sa_mutex);
-	l = malloc(sizeof(sicm_arena_list) + sa_num * sizeof(sicm_arena));
-	l->arenas = (sicm_arena *) &l[1];
-	for(i = 0, a = sa_list; i < sa_num && a != NULL; i++, a = a->next) {
-		l->arenas[i] = a;
+	full = sa_npooled >= sa_pool_max;
+	if (!full) {
+		sa->next = sa_pool;
+		sa_pool = sa;
+		sa_npooled++;
 	}
-	l->count = i;
-	free(l);
 	pthread_mutex_unlock(&sa_mutex);
 
-	return l;
+	return !full;
 }
 
-sicm_device_list sicm_arena_get_devices(sicm_arena a) {
+// take an arena from the pool and bind it to devs
+static sarena *sa_pool_get(size_t sz, sicm_arena_flags flags, sicm_device_list *devs) {
 	sarena *sa;
-	sicm_device_list ret;
+	ssize_t dirty_ms, muzzy_ms;
+	size_t len;
 
-	ret.count = 0;
-	ret.devices = NULL;
-	sa = a;
+	if (devs == NULL || devs->count == 0 || sicm_device_page_size(devs->devices[0]) * 1024L != sa_page_size)
+		return NULL;
+
+	pthread_mutex_lock(&sa_mutex);
+	sa = sa_pool;
 	if (sa != NULL) {
-		pthread_mutex_lock(sa->mutex);
-		ret.count = sa->devs.count;
-		ret.devices = malloc(ret.count * sizeof(sicm_device*));
-		memcpy(ret.devices, sa->devs.devices, ret.count * sizeof(sicm_device*));
-		pthread_mutex_unlock(sa->mutex);
+		sa_pool = sa->next;
+		sa_npooled--;
 	}
+	pthread_mutex_unlock(&sa_mutex);
 
-	return ret;
-}
-
-// should be called with sa mutex held
-static void sicm_arena_range_move(void *aux, void *start, void *end) {
-	int err;
-	int mpol;
-	unsigned long *nodemaskp, maxnode;
-	sarena *sa = (sarena *) aux;
-
-	switch (sa->flags & SICM_ALLOC_MASK) {
-	case SICM_ALLOC_STRICT:
-		mpol = MPOL_BIND;
-		nodemaskp = sa->nodemask->maskp;
-		maxnode = sa->nodemask->size + 1;
-		break;
+	if (sa == NULL)
+		return NULL;
 
-	case SICM_ALLOC_RELAXED:
-		// TODO: this will work only for single device, fix it
-		mpol = MPOL_PREFERRED;
-		nodemaskp = sa->nodemask->maskp;
-		maxnode = sa->nodemask->size + 1;
-		break;
+	pthread_mutex_lock(sa->mutex);
+	sa->flags = flags;
+	sa->maxsize = sz;
+	sa->spilled = 0;
+	sa->peak_spilled = 0;
+	sa->weighted_cuts = 0;
+	sa->max_cached = SARENA_CACHE_DEFAULT;
+	sa->populate = SICM_POPULATE_EAGER;
+	sa->populate_threads = 1;
+	sa->err = 0;
+	pthread_mutex_unlock(sa->mutex);
 
-	default:
-		mpol = MPOL_DEFAULT;
-		nodemaskp = NULL;
-		maxnode = 0;
-		break;
+	// moves the retained extents too, their pages were purged
+	if (sicm_arena_set_devices(sa, devs) != 0 || sa_link(sa) != 0) {
+		sa_free(sa);
+		return NULL;
 	}
 
-	err = mbind((void *) start, (char*) end - (char*) start, mpol, nodemaskp, maxnode, MPOL_MF_MOVE);
-	if (err < 0 && sa->err == 0)
-		sa->err = err;
+	len = sizeof(ssize_t);
+	if (je_mallctl("arenas.dirty_decay_ms", (void *) &dirty_ms, &len, NULL, 0) == 0 &&
+	    je_mallctl("arenas.muzzy_decay_ms", (void *) &muzzy_ms, &len, NULL, 0) == 0)
+		sicm_arena_set_decay(sa, dirty_ms, muzzy_ms);
+
+	return sa;
 }
 
-// FIXME: doesn't support moving to huge pages
-int sicm_arena_set_devices(sicm_arena a, sicm_device_list *devs) {
-	int err, node, oldnumaid;
-	size_t i;
+sicm_arena sicm_arena_create(size_t sz, sicm_arena_flags flags, sicm_device_list *devs) {
 	sarena *sa;
-	struct bitmask *nodemask, *oldnodemask;
 
-	sa = a;
-	if (sa == NULL)
-		return -EINVAL;
+	pthread_once(&sa_init, sarena_init);
 
-	nodemask = sicm_device_list_check_numa(devs);
-	if (nodemask == NULL)
-		return -EINVAL;
+	sa = sa_pool_get(sz, flags, devs);
+	if (sa != NULL)
+		return sa;
 
-	if (sicm_device_page_size(devs->devices[0]) != sicm_device_page_size(sa->devs.devices[0]))
-		return -EINVAL;
+	return sicm_arena_new(sz, flags, devs, -1, 0, -1, 0);
+}
 
-	err = 0;
-	pthread_mutex_lock(sa->mutex);
-	oldnodemask = sa->nodemask;
-	sa->nodemask = nodemask;
-	sa->err = 0;
-	extent_arr_for(sa->extents, i) {
-		if(!sa->extents->arr[i].start && !sa->extents->arr[i].end) continue;
-		sicm_arena_range_move(sa, sa->extents->arr[i].start, sa->extents->arr[i].end);
-	}
+int sicm_arena_pool_reserve(unsigned n) {
+	sicm_device_list dl;
+	sicm_device *dev;
+	sarena *sa;
+	unsigned npooled;
 
-	if (sa->err) {
-		// at least one extent wasn't moved, try to roll back the ones that succeeded
-		err = sa->err;
-		sa->nodemask = oldnodemask;
-		sa->err = 0;
-		extent_arr_for(sa->extents, i) {
-			if(!sa->extents->arr[i].start && !sa->extents->arr[i].end) continue;
-			sicm_arena_range_move(sa, sa->extents->arr[i].start, sa->extents->arr[i].end);
+	pthread_once(&sa_init, sarena_init);
+
+	pthread_mutex_lock(&sa_mutex);
+	sa_pool_max = n;
+	npooled = sa_npooled;
+	pthread_mutex_unlock(&sa_mutex);
+
+	// the arenas are bound to their real devices when they are used
+	dev = sicm_default_device(-1);
+	if (dev == NULL)
+		return n > npooled ? -EINVAL : 0;
+
+	dl.count = 1;
+	dl.devices = &dev;
+	for(; npooled < n; npooled++) {
+		sa = sicm_arena_new(0, 0, &dl, -1, 0, -1, 0);
+		if (sa == NULL)
+			return -ENOMEM;
+
+		sa_unlink(sa);
+		if (!sa_pool_put(sa)) {
+			sa_free(sa);
+			break;
 		}
-		// TODO: not sure what to do if moving back fails
-		numa_free_nodemask(nodemask);
-		err = sa->err;
-	} else {
-		sa->devs.count = devs->count;
-		sa->devs.devices = realloc(sa->devs.devices, devs->count * sizeof(sicm_device *));
-		memcpy(sa->devs.devices, devs->devices, devs->count * sizeof(sicm_device *));
-		numa_free_nodemask(oldnodemask);
 	}
 
-	pthread_mutex_unlock(sa->mutex);
-
-	return err;
+	return 0;
 }
 
-size_t sicm_arena_size(sicm_arena a) {
-	size_t ret;
-	sarena *sa;
+sicm_arena sicm_arena_create_mmapped(size_t sz, sicm_arena_flags flags, sicm_device_list *devs, int fd,
+						off_t offset, int mutex_fd, off_t mutex_offset) {
+	return sicm_arena_new(sz, flags, devs, fd, offset, mutex_fd, mutex_offset);
+}
 
-	sa = a;
-	pthread_mutex_lock(sa->mutex);
-	ret = sa->size;
-	pthread_mutex_unlock(sa->mutex);
+// Make a file at least size bytes long, but not longer than max (0 is
+// unlimited). The file grows in SARENA_FILE_CHUNK steps, preallocated with
+// fallocate where the file system supports it. *cur is the size the file
+// was grown to so far.
+static int sa_file_grow(int fd, off_t *cur, off_t size, off_t max) {
+	off_t newsize;
+
+	if (size <= *cur)
+		return 0;
+
+	newsize = sicm_div_ceil(size, SARENA_FILE_CHUNK) * SARENA_FILE_CHUNK;
+	if (max > 0 && newsize > max)
+		newsize = max;
+
+	if (fallocate(fd, 0, *cur, newsize - *cur) != 0) {
+		if (errno != EOPNOTSUPP)
+			return -errno;
+		if (ftruncate(fd, newsize) != 0)
+			return -errno;
+	}
 
-	return ret;
+	*cur = newsize;
+	return 0;
 }
 
-void *sicm_arena_alloc(sicm_arena a, size_t sz) {
+sicm_arena sicm_arena_open_persistent(const char *path, size_t sz, sicm_arena_flags flags, sicm_device_list *devs, void *base) {
+	sarena_persist hdr, *p;
 	sarena *sa;
-	int flags;
+	void *addr;
+	off_t size;
+	ssize_t n;
+	int i, fd, created, reserved;
 
-	if (sz == 0) {
-		return je_malloc(0);
+	pthread_once(&sa_init, sarena_init);
+
+	if (path == NULL || devs == NULL || devs->count == 0)
+		return NULL;
+
+	// the file must be mapped at the same address every time, and file
+	// mappings can't use hugetlb pages
+	for(i = 0; i < devs->count; i++) {
+		if (!sicm_can_place_exact(devs->devices[i]) ||
+		    sicm_device_page_size(devs->devices[i]) * 1024L != sa_page_size)
+			return NULL;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return NULL;
+
+	// reattach to an existing arena, or start a new one in an empty file;
+	// anything else isn't ours to overwrite
+	created = 0;
+	n = pread(fd, &hdr, sizeof(hdr), 0);
+	if (n == sizeof(hdr) && hdr.magic == SARENA_PERSIST_MAGIC) {
+		if (hdr.version != SARENA_PERSIST_VERSION || (base != NULL && (uintptr_t) base != hdr.base))
+			goto close_fd;
+
+		base = (void *) (uintptr_t) hdr.base;
+		sz = hdr.capacity;
+	} else if (n == 0 && sz > sa_page_size) {
+		sz = sicm_div_ceil(sz, sa_page_size) * sa_page_size;
+		created = 1;
+	} else {
+		goto close_fd;
+	}
+
+	// without a base address, use one that is free now; later runs must
+	// find it free too
+	reserved = 0;
+	if (base == NULL) {
+		base = mmap(NULL, sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base == MAP_FAILED)
+			goto close_fd;
+		reserved = 1;
+	}
+
+	addr = mmap(base, sz, PROT_READ | PROT_WRITE, MAP_SHARED | (reserved ? MAP_FIXED : MAP_FIXED_NOREPLACE), fd, 0);
+	if (addr != base) {
+		if (addr != MAP_FAILED)
+			munmap(addr, sz);
+		if (reserved)
+			munmap(base, sz);
+		goto close_fd;
+	}
+
+	size = lseek(fd, 0, SEEK_END);
+	p = addr;
+	if (created) {
+		if (sa_file_grow(fd, &size, sa_page_size, sz) != 0)
+			goto unmap;
+
+		p->version = SARENA_PERSIST_VERSION;
+		p->base = (uintptr_t) base;
+		p->capacity = sz;
+		p->used = sa_page_size;
+		p->root = 0;
+		__atomic_store_n(&p->magic, SARENA_PERSIST_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	// the capacity is enforced by sa_persist_reserve
+	sa = sicm_arena_new(0, flags, devs, -1, 0, -1, 0);
+	if (sa == NULL)
+		goto unmap;
+
+	pthread_mutex_lock(sa->mutex);
+	sa->fd = fd;
+	sa->file_size = size;
+	sa->persist = p;
+	pthread_mutex_unlock(sa->mutex);
+
+	return sa;
+
+unmap:
+	munmap(addr, sz);
+close_fd:
+	close(fd);
+	return NULL;
+}
+
+void *sicm_arena_get_root(sicm_arena a) {
+	sarena *sa;
+
+	sa = a;
+	if (sa == NULL || sa->persist == NULL)
+		return NULL;
+
+	return (void *) (uintptr_t) __atomic_load_n(&sa->persist->root, __ATOMIC_ACQUIRE);
+}
+
+int sicm_arena_set_root(sicm_arena a, void *root) {
+	sarena *sa;
+
+	sa = a;
+	if (sa == NULL || sa->persist == NULL)
+		return -EINVAL;
+
+	__atomic_store_n(&sa->persist->root, (uint64_t) (uintptr_t) root, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int sicm_arena_sync(sicm_arena a) {
+	sarena *sa;
+	size_t used;
+
+	sa = a;
+	if (sa == NULL || sa->fd == -1)
+		return -EINVAL;
+
+	if (sa->persist == NULL)
+		return fsync(sa->fd) != 0 ? -errno : 0;
+
+	pthread_mutex_lock(sa->mutex);
+	used = sa->persist->used;
+	pthread_mutex_unlock(sa->mutex);
+
+	return msync(sa->persist, used, MS_SYNC) != 0 ? -errno : 0;
+}
+
+sicm_arena sicm_arena_create_spill(size_t sz, sicm_arena_flags flags, sicm_device_list *devs, sicm_device_list *fallback) {
+	sarena *sa;
+	sicm_device **devices;
+	size_t *sizes;
+	unsigned i;
+
+	if (devs == NULL || devs->count == 0 || fallback == NULL || fallback->count == 0)
+		return NULL;
+
+	// spilled extents use the arena's page size
+	for(i = 0; i < fallback->count; i++) {
+		if (sicm_numa_id(fallback->devices[i]) < 0 ||
+		    sicm_device_page_size(fallback->devices[i]) != sicm_device_page_size(devs->devices[0]))
+			return NULL;
+	}
+
+	devices = malloc(fallback->count * sizeof(sicm_device *));
+	sizes = calloc(fallback->count, sizeof(size_t));
+	if (devices == NULL || sizes == NULL)
+		goto error;
+
+	sa = sicm_arena_new(sz, flags, devs, -1, 0, -1, 0);
+	if (sa == NULL)
+		goto error;
+
+	memcpy(devices, fallback->devices, fallback->count * sizeof(sicm_device *));
+	pthread_mutex_lock(sa->mutex);
+	sa->fallback.count = fallback->count;
+	sa->fallback.devices = devices;
+	sa->fallback_size = sizes;
+	pthread_mutex_unlock(sa->mutex);
+
+	return sa;
+
+error:
+	free(devices);
+	free(sizes);
+	return NULL;
+}
+
+void sicm_arena_destroy(sicm_arena arena) {
+	sarena *sa = arena;
+	sicm_migration *m;
+
+	if (sa == NULL)
+		return;
+
+	// a running migration still uses the arena, stop it first
+	pthread_rwlock_rdlock(&sa->migrate_lock);
+	m = sa->migration;
+	if (m != NULL)
+		__atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&sa->migrate_lock);
+
+	if (m != NULL) {
+		sicm_migration_cancel(m);
+		sicm_migration_free(m);
+	}
+
+	sa_unlink(sa);
+	if (!sa_pool_put(sa))
+		sa_free(sa);
+}
+
+// destroy the jemalloc arena and free everything, the arena must already be unlinked
+static void sa_free(sarena *sa) {
+	extent_leaf *l;
+	char str[32];
+	size_t i, arena_ind_sz;
+
+	/* Free up the arena */
+	snprintf(str, sizeof(str), "arena.%u.destroy", sa->arena_ind);
+	arena_ind_sz = sizeof(unsigned);
+	je_mallctl(str, (void *) &sa->arena_ind, &arena_ind_sz, NULL, 0);
+
+	// jemalloc doesn't know about the cached extents anymore
+	for(i = 0; i < sa->ncached; i++)
+		sa_unmap(sa, sa->cache[i].start, sa->cache[i].size);
+
+	// hugetlb extents are never unmapped by sa_dalloc
+	extent_arr_lock(sa->huge_extents);
+	extent_arr_for(sa->huge_extents, l, i) {
+		extent_arr_delete(sa_extents, l->ext[i].start);
+		munmap(l->ext[i].start, (char *) l->ext[i].end - (char *) l->ext[i].start);
+	}
+	extent_arr_unlock(sa->huge_extents);
+
+	// the file stays, the next sicm_arena_open_persistent maps it again
+	if (sa->persist != NULL) {
+		munmap(sa->persist, sa->persist->capacity);
+		close(sa->fd);
+	}
+
+	extent_arr_free(sa->huge_extents);
+	extent_arr_free(sa->extents);
+	pthread_rwlock_destroy(&sa->migrate_lock);
+	free(sa->tcaches);
+	munmap(sa->mutex, sizeof(pthread_mutex_t));
+	free(sa->devs.devices);
+	free(sa->fallback.devices);
+	free(sa->fallback_size);
+	for(i = 0; i < sa->noverrides; i++)
+		free(sa->overrides[i].pol.mask);
+	free(sa->overrides);
+	free(sa->moved);
+	numa_free_nodemask(sa->nodemask);
+	free(sa);
+}
+
+sicm_arena_list *sicm_arenas_list() {
+	int i;
+	sicm_arena_list *l;
+	sarena *a;
+
+	pthread_mutex_lock(&sa_mutex);
+	l = malloc(sizeof(sicm_arena_list) + sa_num * sizeof(sicm_arena));
+	l->arenas = (sicm_arena *) &l[1];
+	for(i = 0, a = sa_list; i < sa_num && a != NULL; i++, a = a->next) {
+		l->arenas[i] = a;
+	}
+	l->count = i;
+	free(l);
+	pthread_mutex_unlock(&sa_mutex);
+
+	return l;
+}
+
+sicm_device_list sicm_arena_get_devices(sicm_arena a) {
+	sarena *sa;
+	sicm_device_list ret;
+
+	ret.count = 0;
+	ret.devices = NULL;
+	sa = a;
+	if (sa != NULL) {
+		pthread_mutex_lock(sa->mutex);
+		ret.count = sa->devs.count;
+		ret.devices = malloc(ret.count * sizeof(sicm_device*));
+		memcpy(ret.devices, sa->devs.devices, ret.count * sizeof(sicm_device*));
+		pthread_mutex_unlock(sa->mutex);
+	}
+
+	return ret;
+}
+
+// page size of the extent that contains addr
+static size_t sa_extent_page_size(sarena *sa, void *addr) {
+	extent_info info;
+
+	if (extent_arr_lookup(sa->huge_extents, addr, &info))
+		return (uintptr_t) info.arena;
+
+	return sa_page_size;
+}
+
+/* The arena's own index keeps the tier of each extent (fallback device
+ * index + 1, 0 for the arena's devices) in the low bits of the arena
+ * pointer, and the log2 of its SICM_ALLOC_WEIGHTED stripe size above them.
+ */
+#define SA_EXT_TIER_BITS 16
+
+static void *sa_ext_val(unsigned tier, unsigned shift) {
+	return (void *) (uintptr_t) (tier | (uintptr_t) shift << SA_EXT_TIER_BITS);
+}
+
+static unsigned sa_ext_tier(void *val) {
+	return (uintptr_t) val & ((1U << SA_EXT_TIER_BITS) - 1);
+}
+
+static unsigned sa_ext_shift(void *val) {
+	return (uintptr_t) val >> SA_EXT_TIER_BITS;
+}
+
+// index value of the extent at addr, see sa_ext_val
+static void *sa_extent_val(sarena *sa, void *addr) {
+	extent_info info;
+
+	if (extent_arr_lookup(sa->extents, addr, &info))
+		return info.arena;
+
+	return sa_ext_val(0, 0);
+}
+
+// node that the extents of a tier are bound to, -1 for the arena's devices
+static int sa_tier_node(sarena *sa, unsigned tier) {
+	return tier == 0 ? -1 : sicm_numa_id(sa->fallback.devices[tier - 1]);
+}
+
+// should be called with sa mutex held
+static void sa_account(sarena *sa, unsigned tier, size_t size, int add) {
+	if (add)
+		sa->size += size;
+	else
+		sa->size -= size;
+
+	if (tier == 0)
+		return;
+
+	if (add) {
+		sa->fallback_size[tier - 1] += size;
+		sa->spilled += size;
+		if (sa->spilled > sa->peak_spilled)
+			sa->peak_spilled = sa->spilled;
+	} else {
+		sa->fallback_size[tier - 1] -= size;
+		sa->spilled -= size;
+	}
+}
+
+// Free memory of a node in bytes, or -1. This is the snapshot sicm_avail
+// keeps, so it doesn't read sysfs on every extent allocation.
+static long long sa_node_free(int node) {
+	sicm_device *dev;
+	size_t avail;
+
+	dev = sicm_node_device(node, 0);
+	if (dev == NULL)
+		return -1;
+
+	avail = sicm_avail(dev);
+	return avail == (size_t) -1 ? -1 : (long long) avail * 1024;
+}
+
+// Fallback device for an extent that would exceed maxsize: the first one
+// with enough free memory, or the last one. 0 if the arena has none.
+// Should be called with sa mutex held.
+static unsigned sa_spill_tier(sarena *sa, size_t size) {
+	unsigned i;
+
+	if (sa->fallback.count == 0)
+		return 0;
+
+	for(i = 0; i + 1 < sa->fallback.count; i++) {
+		if (sa_node_free(sicm_numa_id(sa->fallback.devices[i])) >= (long long) size)
+			return i + 1;
+	}
+
+	return sa->fallback.count;
+}
+
+/* Every run of SICM_ALLOC_WEIGHTED stripes on one node is a VMA of its
+ * own. An extent is split into at most SA_WEIGHTED_MAX_RUNS of them, and
+ * all extents of an arena into at most SA_WEIGHTED_MAX_CUTS more VMAs than
+ * there are extents, well below the default vm.max_map_count of 65530.
+ */
+#define SA_WEIGHTED_MAX_RUNS 512
+#define SA_WEIGHTED_MAX_CUTS 16384
+
+// smallest SICM_ALLOC_WEIGHTED stripe size for a mapping with the given page size
+static size_t sa_stripe_size(size_t pgsz) {
+	return pgsz > sa_thp_size ? pgsz : sa_thp_size;
+}
+
+// Stripe boundaries inside (start, end) with stripes of 1 << shift bytes,
+// none for shift 0 (extents that aren't striped). Splitting an extent at a
+// stripe boundary removes that boundary from the count, merging adds it.
+static size_t sa_weighted_cuts(void *start, void *end, unsigned shift) {
+	if (shift == 0)
+		return 0;
+
+	return (((uintptr_t) end - 1) >> shift) - ((uintptr_t) start >> shift);
+}
+
+// Stripe size (log2) for a new extent [start, end): the smallest one from
+// sa_stripe_size on that keeps the extent within SA_WEIGHTED_MAX_RUNS runs
+// and the arena within SA_WEIGHTED_MAX_CUTS. Once the arena is out of
+// boundaries, each new extent goes to a single node as a whole. Should be
+// called with sa mutex held.
+static unsigned sa_weighted_shift(sarena *sa, void *start, void *end, size_t pgsz) {
+	size_t budget, used;
+	unsigned shift;
+
+	used = __atomic_load_n(&sa->weighted_cuts, __ATOMIC_RELAXED);
+	budget = used < SA_WEIGHTED_MAX_CUTS ? SA_WEIGHTED_MAX_CUTS - used : 0;
+	if (budget > SA_WEIGHTED_MAX_RUNS - 1)
+		budget = SA_WEIGHTED_MAX_RUNS - 1;
+
+	shift = __builtin_ctzl(sa_stripe_size(pgsz));
+	while (shift < 8 * sizeof(uintptr_t) - 1 && sa_weighted_cuts(start, end, shift) > budget)
+		shift++;
+
+	return shift;
+}
+
+// node of the stripe that contains addr
+static int sa_weighted_node(sa_policy *pol, void *addr, unsigned shift) {
+	unsigned slot, i;
+
+	slot = ((uintptr_t) addr >> shift) % pol->nodes.total;
+	for(i = 0; slot >= pol->nodes.weight[i]; i++)
+		slot -= pol->nodes.weight[i];
+
+	return pol->nodes.node[i];
+}
+
+// whether all nodes of the policy have the same SICM_ALLOC_WEIGHTED weight
+static int sa_weights_equal(sa_policy *pol) {
+	unsigned i;
+
+	for(i = 1; i < pol->nodes.count; i++) {
+		if (pol->nodes.weight[i] != pol->nodes.weight[0])
+			return 0;
+	}
+
+	return 1;
+}
+
+// end of the run of stripes from start on that go to the same node
+static char *sa_weighted_run_end(sa_policy *pol, char *start, char *end, unsigned shift) {
+	char *next;
+	int node;
+
+	node = sa_weighted_node(pol, start, shift);
+	next = start;
+	do {
+		next = (char *) ((((uintptr_t) next >> shift) + 1) << shift);
+	} while (next < end && sa_weighted_node(pol, next, shift) == node);
+
+	return next > end ? end : next;
+}
+
+// first node in the list with room for size bytes, the last one if none has
+static int sa_ordered_node(sa_policy *pol, size_t size) {
+	unsigned i;
+
+	for(i = 0; i + 1 < pol->nodes.count; i++) {
+		if (sa_node_free(pol->nodes.node[i]) >= (long long) size)
+			return pol->nodes.node[i];
+	}
+
+	return pol->nodes.node[pol->nodes.count - 1];
+}
+
+static unsigned sa_policy_copy(sarena *, sa_policy *);
+static int sa_mbind(sarena *, void *, size_t, sa_policy *, int, unsigned, unsigned);
+static int sa_mbind_pol(void *, size_t, sa_policy *, unsigned);
+
+// Add [start, end) of an override to the bytes moved to each node, or
+// take it away. The pages are counted as spread over the override's nodes
+// like MPOL_INTERLEAVE does, so the parts of a split or trimmed override
+// add up to the whole. Should be called with sa mutex held.
+static void sa_override_account(sarena *sa, sa_policy *pol, void *start, void *end, int add) {
+	uintptr_t s, e, n;
+	unsigned c, k;
+
+	if (sa->moved == NULL)
+		return;
+
+	c = pol->nodes.count;
+	s = (uintptr_t) start / sa_page_size;
+	e = (uintptr_t) end / sa_page_size;
+	for(k = 0; k < c; k++) {
+		// pages in [s, e) whose index is k modulo c
+		n = (e + c - 1 - k) / c - (s + c - 1 - k) / c;
+		if (add)
+			sa->moved[pol->nodes.node[k]] += n * sa_page_size;
+		else
+			sa->moved[pol->nodes.node[k]] -= n * sa_page_size;
+	}
+}
+
+// Drop the overrides in [start, end), splitting the ones that only
+// partially overlap it. Should be called with sa mutex held.
+static int sa_override_clear(sarena *sa, void *start, void *end) {
+	sa_override *o, *n;
+	size_t i;
+
+	for(i = 0; i < sa->noverrides; i++) {
+		o = &sa->overrides[i];
+		if (o->end <= start || o->start >= end)
+			continue;
+
+		if (o->start < start && o->end > end) {
+			// keep both sides
+			if (sa->noverrides == sa->maxoverrides) {
+				n = realloc(sa->overrides, 2 * (sa->maxoverrides + 1) * sizeof(sa_override));
+				if (n == NULL)
+					return -ENOMEM;
+				sa->overrides = n;
+				sa->maxoverrides = 2 * (sa->maxoverrides + 1);
+				o = &sa->overrides[i];
+			}
+
+			n = &sa->overrides[sa->noverrides];
+			*n = *o;
+			n->pol.mask = malloc(sa_mask_longs * sizeof(unsigned long));
+			if (n->pol.mask == NULL)
+				return -ENOMEM;
+			memcpy(n->pol.mask, o->pol.mask, sa_mask_longs * sizeof(unsigned long));
+			sa_override_account(sa, &o->pol, start, end, 0);
+			n->start = end;
+			o->end = start;
+			__atomic_add_fetch(&sa->noverrides, 1, __ATOMIC_RELAXED);
+		} else if (o->start < start) {
+			sa_override_account(sa, &o->pol, start, o->end, 0);
+			o->end = start;
+		} else if (o->end > end) {
+			sa_override_account(sa, &o->pol, o->start, end, 0);
+			o->start = end;
+		} else {
+			sa_override_account(sa, &o->pol, o->start, o->end, 0);
+			free(o->pol.mask);
+			*o = sa->overrides[sa->noverrides - 1];
+			__atomic_sub_fetch(&sa->noverrides, 1, __ATOMIC_RELAXED);
+			i--;
+		}
+	}
+
+	return 0;
+}
+
+// Drop the overrides that overlap [start, end) as a whole, for when
+// sa_override_clear can't split one. Should be called with sa mutex held.
+static void sa_override_drop(sarena *sa, void *start, void *end) {
+	sa_override *o;
+	size_t i;
+
+	for(i = 0; i < sa->noverrides; i++) {
+		o = &sa->overrides[i];
+		if (o->end <= start || o->start >= end)
+			continue;
+
+		sa_override_account(sa, &o->pol, o->start, o->end, 0);
+		free(o->pol.mask);
+		*o = sa->overrides[sa->noverrides - 1];
+		__atomic_sub_fetch(&sa->noverrides, 1, __ATOMIC_RELAXED);
+		i--;
+	}
+}
+
+// Bind the parts of [start, end) that have an override to their own
+// devices. Should be called with sa mutex held.
+static void sa_override_apply(sarena *sa, void *start, void *end, unsigned flags) {
+	sa_override *o;
+	char *s, *e;
+	size_t i;
+
+	for(i = 0; i < sa->noverrides; i++) {
+		o = &sa->overrides[i];
+		s = (char *) (o->start > start ? o->start : start);
+		e = (char *) (o->end < end ? o->end : end);
+		if (s < e && sa_mbind_pol(s, e - s, &o->pol, flags) < 0 && sa->err == 0)
+			sa->err = -errno;
+	}
+}
+
+// Find the first part of [p, end) that has no override. Returns its start
+// and sets *gend to its end, or returns end if there is none. Should be
+// called with sa mutex held.
+static char *sa_override_gap(sarena *sa, char *p, char *end, char **gend) {
+	sa_override *o;
+	size_t i;
+	int skipped;
+
+	// skip the overrides that p is in, they may be back to back
+	do {
+		skipped = 0;
+		for(i = 0; i < sa->noverrides && p < end; i++) {
+			o = &sa->overrides[i];
+			if ((char *) o->start <= p && (char *) o->end > p) {
+				p = o->end;
+				skipped = 1;
+			}
+		}
+	} while (skipped && p < end);
+
+	*gend = end;
+	for(i = 0; i < sa->noverrides; i++) {
+		o = &sa->overrides[i];
+		if ((char *) o->start > p && (char *) o->start < *gend)
+			*gend = o->start;
+	}
+
+	return p < end ? p : end;
+}
+
+// Bind and move an extent to the arena's devices. Ranges moved with
+// sicm_arena_move_range keep theirs and are left alone. Should be called
+// with sa mutex held.
+static void sicm_arena_range_move(sarena *sa, extent_info *ext) {
+	unsigned long mask[sa_mask_longs];
+	sa_policy pol;
+	char *p, *e, *end;
+	int node;
+
+	// extents that spilled stay on their fallback device, and the parts
+	// of a SICM_ALLOC_ORDERED extent all go to the same node
+	pol.mask = mask;
+	sa_policy_copy(sa, &pol);
+	end = ext->end;
+	node = sa_tier_node(sa, sa_ext_tier(ext->arena));
+	if (node < 0 && (sa->flags & SICM_ALLOC_MASK) == SICM_ALLOC_ORDERED)
+		node = sa_ordered_node(&pol, end - (char *) ext->start);
+
+	for(p = sa_override_gap(sa, ext->start, end, &e); p < end; p = sa_override_gap(sa, e, end, &e)) {
+		if (sa_mbind(sa, p, e - p, &pol, node, sa_ext_shift(ext->arena), MPOL_MF_MOVE) < 0 && sa->err == 0)
+			sa->err = -errno;
+	}
+}
+
+int sicm_arena_move_range(sicm_arena a, void *start, size_t len, sicm_device_list *devs) {
+	sarena *sa;
+	struct bitmask *nodemask;
+	sa_override *o;
+	sa_policy pol;
+	extent_info ext;
+	unsigned long mask[sa_mask_longs];
+	size_t pgsz;
+	char *s, *e, *p, *end;
+	int err, mode;
+
+	sa = a;
+	if (sa == NULL || start == NULL || len == 0)
+		return -EINVAL;
+
+	// whole pages of the extents' page size
+	pgsz = sa_extent_page_size(sa, start);
+	s = (char *) ((uintptr_t) start & ~(pgsz - 1));
+	e = (char *) (sicm_div_ceil((uintptr_t) start + len, pgsz) * pgsz);
+
+	// the whole range must belong to the arena
+	for(p = s; p < e; p = ext.end) {
+		if (!extent_arr_lookup(sa->extents, p, &ext))
+			return -EINVAL;
+	}
+
+	pol.mask = mask;
+	if (devs != NULL) {
+		nodemask = sicm_device_list_check_numa(devs);
+		if (nodemask == NULL)
+			return -EINVAL;
+
+		// SICM_ALLOC_WEIGHTED and SICM_ALLOC_ORDERED place whole extents,
+		// a range just prefers its devices
+		memcpy(pol.mask, nodemask->maskp, sa_mask_longs * sizeof(unsigned long));
+		pol.maxnode = nodemask->size + 1;
+		numa_free_nodemask(nodemask);
+		sa_nodes_init(&pol.nodes, devs);
+		mode = sa->flags & SICM_ALLOC_MASK;
+		pol.mpol = sa_mpol(mode == SICM_ALLOC_WEIGHTED || mode == SICM_ALLOC_ORDERED ? SICM_ALLOC_RELAXED : sa->flags, pol.nodes.count);
+	}
+
+	// The workers of a migration don't touch the overrides, so one can't
+	// come or go halfway through.
+	pthread_rwlock_rdlock(&sa->migrate_lock);
+	if (sa->migration != NULL) {
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		return -EBUSY;
+	}
+
+	pthread_mutex_lock(sa->mutex);
+	err = sa_override_clear(sa, s, e);
+	if (err == 0 && devs != NULL) {
+		if (sa->moved == NULL) {
+			sa->moved = calloc(numa_max_node() + 1, sizeof(size_t));
+			if (sa->moved == NULL) {
+				err = -ENOMEM;
+				goto out;
+			}
+		}
+
+		if (sa->noverrides == sa->maxoverrides) {
+			o = realloc(sa->overrides, 2 * (sa->maxoverrides + 1) * sizeof(sa_override));
+			if (o == NULL) {
+				err = -ENOMEM;
+				goto out;
+			}
+			sa->overrides = o;
+			sa->maxoverrides = 2 * (sa->maxoverrides + 1);
+		}
+
+		o = &sa->overrides[sa->noverrides];
+		o->start = s;
+		o->end = e;
+		o->pol = pol;
+		o->pol.mask = malloc(sa_mask_longs * sizeof(unsigned long));
+		if (o->pol.mask == NULL) {
+			err = -ENOMEM;
+			goto out;
+		}
+		memcpy(o->pol.mask, mask, sa_mask_longs * sizeof(unsigned long));
+		sa_override_account(sa, &o->pol, s, e, 1);
+		__atomic_add_fetch(&sa->noverrides, 1, __ATOMIC_RELAXED);
+	} else if (err == 0) {
+		// back to the arena's own placement, extent by extent
+		sa_policy_copy(sa, &pol);
+	}
+	pthread_mutex_unlock(sa->mutex);
+	if (err != 0)
+		goto unlock;
+
+	// moving the pages can take a while, don't block sa_alloc meanwhile
+	if (devs != NULL) {
+		if (sa_mbind_pol(s, e - s, &pol, MPOL_MF_MOVE) < 0)
+			err = -errno;
+		goto unlock;
+	}
+
+	for(p = s; p < e; p = end) {
+		if (!extent_arr_lookup(sa->extents, p, &ext)) {
+			err = -EINVAL;
+			goto unlock;
+		}
+
+		end = (char *) ext.end < e ? (char *) ext.end : e;
+		if (sa_mbind(sa, p, end - p, &pol, sa_tier_node(sa, sa_ext_tier(ext.arena)), sa_ext_shift(ext.arena), MPOL_MF_MOVE) < 0) {
+			err = -errno;
+			goto unlock;
+		}
+	}
+
+	goto unlock;
+
+out:
+	pthread_mutex_unlock(sa->mutex);
+unlock:
+	pthread_rwlock_unlock(&sa->migrate_lock);
+	return err;
+}
+
+size_t sicm_arena_moved_size(sicm_arena a, sicm_device *dev) {
+	sarena *sa;
+	size_t ret;
+	int node;
+
+	sa = a;
+	if (sa == NULL || dev == NULL)
+		return 0;
+
+	node = sicm_numa_id(dev);
+	if (node < 0 || node > numa_max_node())
+		return 0;
+
+	pthread_mutex_lock(sa->mutex);
+	ret = sa->moved != NULL ? sa->moved[node] : 0;
+	pthread_mutex_unlock(sa->mutex);
+
+	return ret;
+}
+
+int sicm_arena_set_devices(sicm_arena a, sicm_device_list *devs) {
+	int err, oldmpol;
+	size_t i;
+	sarena *sa;
+	extent_leaf *l;
+	struct bitmask *nodemask, *oldnodemask;
+	sarena_nodes oldnodes;
+
+	sa = a;
+	if (sa == NULL)
+		return -EINVAL;
+
+	nodemask = sicm_device_list_check_numa(devs);
+	if (nodemask == NULL)
+		return -EINVAL;
+
+	pthread_rwlock_rdlock(&sa->migrate_lock);
+	if (sa->migration != NULL) {
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		numa_free_nodemask(nodemask);
+		return -EBUSY;
+	}
+
+	err = 0;
+	pthread_mutex_lock(sa->mutex);
+	oldnodemask = sa->nodemask;
+	oldnodes = sa->nodes;
+	oldmpol = sa->mpol;
+	sa->nodemask = nodemask;
+	sa_nodes_init(&sa->nodes, devs);
+	sa->mpol = sa_mpol(sa->flags, sa->nodes.count);
+	__atomic_add_fetch(&sa->policy_gen, 1, __ATOMIC_RELEASE);
+	sa->err = 0;
+	extent_arr_lock(sa->extents);
+	extent_arr_for(sa->extents, l, i) {
+		sicm_arena_range_move(sa, &l->ext[i]);
+	}
+
+	if (sa->err) {
+		// at least one extent wasn't moved, try to roll back the ones that succeeded
+		err = sa->err;
+		sa->nodemask = oldnodemask;
+		sa->nodes = oldnodes;
+		sa->mpol = oldmpol;
+		__atomic_add_fetch(&sa->policy_gen, 1, __ATOMIC_RELEASE);
+		sa->err = 0;
+		extent_arr_for(sa->extents, l, i) {
+			sicm_arena_range_move(sa, &l->ext[i]);
+		}
+		// TODO: not sure what to do if moving back fails
+		numa_free_nodemask(nodemask);
+		err = sa->err;
+	} else {
+		sa->devs.count = devs->count;
+		sa->devs.devices = realloc(sa->devs.devices, devs->count * sizeof(sicm_device *));
+		memcpy(sa->devs.devices, devs->devices, devs->count * sizeof(sicm_device *));
+		sa->pgsz = sicm_device_page_size(devs->devices[0]) * 1024L;
+		numa_free_nodemask(oldnodemask);
+
+		// make the threads flush their tcaches before they use them again
+		__atomic_add_fetch(&sa->tcache_gen, 1, __ATOMIC_RELEASE);
+	}
+
+	extent_arr_unlock(sa->extents);
+	pthread_mutex_unlock(sa->mutex);
+	pthread_rwlock_unlock(&sa->migrate_lock);
+
+	return err;
+}
+
+int sicm_arena_set_weights(sicm_arena a, unsigned *weights) {
+	sarena *sa;
+	sarena_nodes nodes;
+	extent_leaf *l;
+	size_t i;
+	unsigned j;
+	int err;
+
+	sa = a;
+	if (sa == NULL || weights == NULL || (sa->flags & SICM_ALLOC_MASK) != SICM_ALLOC_WEIGHTED)
+		return -EINVAL;
+
+	pthread_rwlock_rdlock(&sa->migrate_lock);
+	if (sa->migration != NULL) {
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		return -EBUSY;
+	}
+
+	pthread_mutex_lock(sa->mutex);
+	nodes = sa->nodes;
+	nodes.total = 0;
+	for(j = 0; j < nodes.count; j++)
+		nodes.weight[j] = 0;
+
+	for(i = 0; i < sa->devs.count; i++) {
+		for(j = 0; j < nodes.count && nodes.node[j] != sicm_numa_id(sa->devs.devices[i]); j++)
+			;
+
+		if (j < nodes.count) {
+			nodes.weight[j] += weights[i];
+			nodes.total += weights[i];
+		}
+	}
+
+	err = -EINVAL;
+	if (nodes.total > 0) {
+		sa->nodes = nodes;
+		__atomic_add_fetch(&sa->policy_gen, 1, __ATOMIC_RELEASE);
+		sa->err = 0;
+		extent_arr_lock(sa->extents);
+		extent_arr_for(sa->extents, l, i) {
+			sicm_arena_range_move(sa, &l->ext[i]);
+		}
+		extent_arr_unlock(sa->extents);
+		err = sa->err;
+	}
+	pthread_mutex_unlock(sa->mutex);
+	pthread_rwlock_unlock(&sa->migrate_lock);
+
+	return err;
+}
+
+// a batch of pages is moved with a single move_pages call
+#define SA_MIGRATE_BATCH 1024
+#define SA_MIGRATE_MAX_THREADS 64
+
+// should be called with m mutex held
+static void sa_migration_fail(sicm_migration *m, void *start, void *end, int err) {
+	sicm_migration_failure *f;
+	size_t n;
+
+	if (m->err == 0)
+		m->err = err;
+
+	// batches of the same extent usually fail for the same reason
+	if (m->nfailures > 0) {
+		f = &m->failures[m->nfailures - 1];
+		if (f->end == start && f->err == err) {
+			f->end = end;
+			return;
+		}
+	}
+
+	if (m->nfailures == m->maxfailures) {
+		n = 2 * (m->maxfailures + 1);
+		f = realloc(m->failures, n * sizeof(sicm_migration_failure));
+		if (f == NULL)
+			return;
+
+		m->failures = f;
+		m->maxfailures = n;
+	}
+
+	f = &m->failures[m->nfailures++];
+	f->start = start;
+	f->end = end;
+	f->err = err;
+}
+
+static void sa_migration_put(sicm_migration *m) {
+	if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	pthread_mutex_destroy(&m->mutex);
+	pthread_cond_destroy(&m->cond);
+	free(m->failures);
+	free(m->ranges);
+	free(m->pol.mask);
+	free(m);
+}
+
+// called by the last worker, after that the migration doesn't touch the arena
+static void sa_migration_done(sicm_migration *m) {
+	sarena *sa;
+
+	sa = m->sa;
+	pthread_rwlock_wrlock(&sa->migrate_lock);
+	sa->migration = NULL;
+	pthread_rwlock_unlock(&sa->migrate_lock);
+
+	pthread_mutex_lock(&m->mutex);
+	m->done = 1;
+	pthread_cond_broadcast(&m->cond);
+	pthread_mutex_unlock(&m->mutex);
+	sa_migration_put(m);
+}
+
+// node that move_pages should put the page at addr on
+static int sa_page_node(sarena *sa, sa_policy *pol, sa_range *r, void *addr) {
+	// SICM_ALLOC_ORDERED and spilled extents
+	if (r->node >= 0)
+		return r->node;
+
+	switch (sa->flags & SICM_ALLOC_MASK) {
+	case SICM_ALLOC_WEIGHTED:
+		if (!sa_weights_equal(pol))
+			return sa_weighted_node(pol, addr, r->shift);
+		return pol->nodes.node[((uintptr_t) addr / r->pgsz) % pol->nodes.count];
+
+	case SICM_ALLOC_RELAXED:
+		return pol->nodes.node[0];
+
+	default:
+		return pol->nodes.node[((uintptr_t) addr / r->pgsz) % pol->nodes.count];
+	}
+}
+
+static void *sa_migrate_worker(void *arg) {
+	sicm_migration *m;
+	void *pages[SA_MIGRATE_BATCH];
+	int nodes[SA_MIGRATE_BATCH], status[SA_MIGRATE_BATCH];
+	char *start, *end;
+	sa_range *r;
+	size_t i, n, failed, pgsz;
+	int err, first;
+
+	m = arg;
+	for(;;) {
+		// grab the next batch
+		pthread_mutex_lock(&m->mutex);
+		while (m->cur < m->nranges && (char *) m->ranges[m->cur].start + m->off >= (char *) m->ranges[m->cur].end) {
+			m->cur++;
+			m->off = 0;
+		}
+
+		if (m->cancelled || m->cur >= m->nranges) {
+			pthread_mutex_unlock(&m->mutex);
+			break;
+		}
+
+		r = &m->ranges[m->cur];
+		pgsz = r->pgsz;
+		start = (char *) r->start + m->off;
+		end = (char *) r->end;
+		if (end - start > SA_MIGRATE_BATCH * pgsz)
+			end = start + SA_MIGRATE_BATCH * pgsz;
+
+		first = m->off == 0;
+		m->off += end - start;
+		pthread_mutex_unlock(&m->mutex);
+
+		// The policy of the whole extent is changed with its first batch,
+		// so pages faulted in from now on land on the new devices too.
+		err = 0;
+		if (first && sa_mbind(m->sa, r->start, (char *) r->end - (char *) r->start, &m->pol, r->node, r->shift, 0) < 0)
+			err = -errno;
+
+		n = (end - start) / pgsz;
+		for(i = 0; i < n; i++) {
+			pages[i] = start + i * pgsz;
+			nodes[i] = sa_page_node(m->sa, &m->pol, r, pages[i]);
+		}
+
+		failed = 0;
+		if (move_pages(0, n, pages, nodes, status, MPOL_MF_MOVE) < 0) {
+			if (err == 0)
+				err = -errno;
+			failed = n;
+		} else {
+			for(i = 0; i < n; i++) {
+				// pages that were never touched or were purged have nothing to move
+				if (status[i] >= 0 || status[i] == -ENOENT || status[i] == -EFAULT)
+					continue;
+
+				if (err == 0)
+					err = status[i];
+				failed++;
+			}
+		}
+
+		pthread_mutex_lock(&m->mutex);
+		m->moved += (n - failed) * pgsz;
+		m->failed += failed * pgsz;
+		if (err != 0)
+			sa_migration_fail(m, start, end, err);
+		pthread_mutex_unlock(&m->mutex);
+	}
+
+	if (__atomic_sub_fetch(&m->workers, 1, __ATOMIC_ACQ_REL) == 0)
+		sa_migration_done(m);
+
+	return NULL;
+}
+
+int sicm_arena_migrate_start(sicm_arena a, sicm_device_list *devs, int nthreads, sicm_migration **mp) {
+	int i, j, err, node, nnodes;
+	size_t n, avail, davail, moving, *sizes;
+	sarena *sa;
+	sicm_migration *m;
+	sa_range *r;
+	extent_leaf *l;
+	extent_info *ext;
+	char *p, *e, *end;
+	struct bitmask *nodemask, *oldnodemask;
+	sicm_device **devices;
+	pthread_attr_t attr;
+	pthread_t t;
+
+	sa = a;
+	if (sa == NULL || devs == NULL || devs->count == 0 || mp == NULL)
+		return -EINVAL;
+
+	nodemask = sicm_device_list_check_numa(devs);
+	if (nodemask == NULL)
+		return -EINVAL;
+
+	// Check if the new devices can take the pages that have to move, the
+	// ones on nodes outside of the new set. Nodes with several devices
+	// only count once.
+	nnodes = numa_max_node() + 1;
+	sizes = calloc(nnodes, sizeof(size_t));
+	if (sizes == NULL) {
+		err = -ENOMEM;
+		goto free_nodemask;
+	}
+
+	err = sa_node_sizes(sa, sizes, nnodes, 1);
+	moving = 0;
+	for(node = 0; node < nnodes; node++) {
+		if (!numa_bitmask_isbitset(nodemask, node))
+			moving += sizes[node];
+	}
+	free(sizes);
+	if (err != 0)
+		goto free_nodemask;
+
+	avail = 0;
+	for(i = 0; i < devs->count; i++) {
+		node = sicm_numa_id(devs->devices[i]);
+		for(j = 0; j < i && sicm_numa_id(devs->devices[j]) != node; j++)
+			;
+
+		davail = j == i ? sicm_avail(devs->devices[i]) : (size_t) -1;
+		if (davail != (size_t) -1)
+			avail += davail * 1024;
+	}
+
+	err = -ENOMEM;
+	if (avail < moving)
+		goto free_nodemask;
+
+	err = -ENOMEM;
+	m = calloc(1, sizeof(sicm_migration));
+	devices = malloc(devs->count * sizeof(sicm_device *));
+	if (m == NULL || devices == NULL)
+		goto free_m;
+
+	m->pol.mask = calloc(sa_mask_longs, sizeof(unsigned long));
+	if (m->pol.mask == NULL)
+		goto free_m;
+
+	pthread_mutex_init(&m->mutex, NULL);
+	pthread_cond_init(&m->cond, NULL);
+	m->sa = sa;
+	m->refs = 2;	// one for the caller, one for the workers
+	memcpy(m->pol.mask, nodemask->maskp, sa_mask_longs * sizeof(unsigned long));
+	m->pol.maxnode = nodemask->size + 1;
+	sa_nodes_init(&m->pol.nodes, devs);
+	m->pol.mpol = sa_mpol(sa->flags, m->pol.nodes.count);
+
+	memcpy(devices, devs->devices, devs->count * sizeof(sicm_device *));
+
+	pthread_rwlock_wrlock(&sa->migrate_lock);
+	if (sa->migration != NULL) {
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		err = -EBUSY;
+		goto destroy_m;
+	}
+
+	pthread_mutex_lock(sa->mutex);
+
+	// Take a snapshot of the extents to move; the ones allocated from now
+	// on get the new policy in sa_alloc. Each override can split an extent
+	// into one more range.
+	extent_arr_lock(sa->extents);
+	m->ranges = malloc((sa->extents->count + sa->noverrides) * sizeof(sa_range));
+	if (m->ranges == NULL) {
+		extent_arr_unlock(sa->extents);
+		pthread_mutex_unlock(sa->mutex);
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		goto destroy_m;
+	}
+
+	extent_arr_for(sa->extents, l, n) {
+		ext = &l->ext[n];
+		end = ext->end;
+		node = sa_tier_node(sa, sa_ext_tier(ext->arena));
+		if (node < 0 && (sa->flags & SICM_ALLOC_MASK) == SICM_ALLOC_ORDERED)
+			node = sa_ordered_node(&m->pol, end - (char *) ext->start);
+
+		// ranges moved with sicm_arena_move_range stay where they are
+		for(p = sa_override_gap(sa, ext->start, end, &e); p < end; p = sa_override_gap(sa, e, end, &e)) {
+			r = &m->ranges[m->nranges++];
+			r->start = p;
+			r->end = e;
+			r->pgsz = sa_extent_page_size(sa, p);
+			r->node = node;
+			r->shift = sa_ext_shift(ext->arena);
+			m->total += e - p;
+		}
+	}
+	extent_arr_unlock(sa->extents);
+
+	oldnodemask = sa->nodemask;
+	sa->nodemask = nodemask;
+	sa->nodes = m->pol.nodes;
+	sa->mpol = m->pol.mpol;
+	__atomic_add_fetch(&sa->policy_gen, 1, __ATOMIC_RELEASE);
+	free(sa->devs.devices);
+	sa->devs.count = devs->count;
+	sa->devs.devices = devices;
+	sa->pgsz = sicm_device_page_size(devices[0]) * 1024L;
+	numa_free_nodemask(oldnodemask);
+
+	// make the threads flush their tcaches before they use them again
+	__atomic_add_fetch(&sa->tcache_gen, 1, __ATOMIC_RELEASE);
+	sa->migration = m;
+	pthread_mutex_unlock(sa->mutex);
+	pthread_rwlock_unlock(&sa->migrate_lock);
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > SA_MIGRATE_MAX_THREADS)
+		nthreads = SA_MIGRATE_MAX_THREADS;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	m->workers = nthreads;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(i = 0; i < nthreads; i++) {
+		err = pthread_create(&t, &attr, sa_migrate_worker, m);
+		if (err == 0)
+			continue;
+
+		// go on with the workers we have, if any
+		if (i == 0) {
+			pthread_mutex_lock(&m->mutex);
+			m->err = -err;
+			pthread_mutex_unlock(&m->mutex);
+		}
+		if (__atomic_sub_fetch(&m->workers, nthreads - i, __ATOMIC_ACQ_REL) == 0)
+			sa_migration_done(m);
+		break;
+	}
+	pthread_attr_destroy(&attr);
+
+	*mp = m;
+	return 0;
+
+destroy_m:
+	pthread_mutex_destroy(&m->mutex);
+	pthread_cond_destroy(&m->cond);
+free_m:
+	if (m != NULL)
+		free(m->pol.mask);
+	free(m);
+	free(devices);
+
+free_nodemask:
+	numa_free_nodemask(nodemask);
+	return err;
+}
+
+int sicm_migration_poll(sicm_migration *m, sicm_migration_status *st) {
+	int done;
+
+	pthread_mutex_lock(&m->mutex);
+	if (st != NULL) {
+		st->total = m->total;
+		st->moved = m->moved;
+		st->failed = m->failed;
+		st->nfailures = m->nfailures;
+		st->err = m->err;
+		st->done = m->done;
+		st->cancelled = m->cancelled;
+	}
+	done = m->done;
+	pthread_mutex_unlock(&m->mutex);
+
+	return done;
+}
+
+int sicm_migration_wait(sicm_migration *m, sicm_migration_status *st) {
+	int err;
+
+	pthread_mutex_lock(&m->mutex);
+	while (!m->done)
+		pthread_cond_wait(&m->cond, &m->mutex);
+	err = m->err;
+	pthread_mutex_unlock(&m->mutex);
+
+	sicm_migration_poll(m, st);
+	return err;
+}
+
+void sicm_migration_cancel(sicm_migration *m) {
+	pthread_mutex_lock(&m->mutex);
+	m->cancelled = 1;
+	pthread_mutex_unlock(&m->mutex);
+}
+
+size_t sicm_migration_failures(sicm_migration *m, sicm_migration_failure *f, size_t n) {
+	size_t ret;
+
+	pthread_mutex_lock(&m->mutex);
+	ret = m->nfailures;
+	if (n > ret)
+		n = ret;
+	memcpy(f, m->failures, n * sizeof(sicm_migration_failure));
+	pthread_mutex_unlock(&m->mutex);
+
+	return ret;
+}
+
+void sicm_migration_free(sicm_migration *m) {
+	if (m == NULL)
+		return;
+
+	sicm_migration_wait(m, NULL);
+	sa_migration_put(m);
+}
+
+size_t sicm_arena_size(sicm_arena a) {
+	size_t ret;
+	sarena *sa;
+
+	sa = a;
+	pthread_mutex_lock(sa->mutex);
+	ret = sa->size;
+	pthread_mutex_unlock(sa->mutex);
+
+	return ret;
+}
+
+static int sa_stat(sarena *sa, const char *name, size_t *val) {
+	char str[64];
+	size_t sz;
+
+	sz = sizeof(size_t);
+	snprintf(str, sizeof(str), "stats.arenas.%u.%s", sa->arena_ind, name);
+	return je_mallctl(str, (void *) val, &sz, NULL, 0);
+}
+
+// Add the resident bytes of the arena's extents to sizes, by node. With
+// movable set, only count what a migration would move: the extents on the
+// arena's devices, without the ranges moved with sicm_arena_move_range.
+// The extents are queried in batches with move_pages, outside of the
+// arena's locks; extents that go away in the meantime just aren't counted.
+static int sa_node_sizes(sarena *sa, size_t *sizes, int nnodes, int movable) {
+	void *pages[SA_MIGRATE_BATCH];
+	int status[SA_MIGRATE_BATCH];
+	sa_range *ranges, *r;
+	extent_leaf *l;
+	extent_info *ext;
+	size_t i, n, nranges;
+	char *p, *e;
+
+	pthread_mutex_lock(sa->mutex);
+	extent_arr_lock(sa->extents);
+	ranges = malloc((sa->extents->count + sa->noverrides + 1) * sizeof(sa_range));
+	if (ranges == NULL) {
+		extent_arr_unlock(sa->extents);
+		pthread_mutex_unlock(sa->mutex);
+		return -ENOMEM;
+	}
+
+	nranges = 0;
+	extent_arr_for(sa->extents, l, n) {
+		ext = &l->ext[n];
+		if (!movable) {
+			r = &ranges[nranges++];
+			r->start = ext->start;
+			r->end = ext->end;
+			r->pgsz = sa_extent_page_size(sa, r->start);
+			continue;
+		}
+
+		if (sa_ext_tier(ext->arena) != 0)
+			continue;
+		for(p = sa_override_gap(sa, ext->start, ext->end, &e); p < (char *) ext->end; p = sa_override_gap(sa, e, ext->end, &e)) {
+			r = &ranges[nranges++];
+			r->start = p;
+			r->end = e;
+			r->pgsz = sa_extent_page_size(sa, p);
+		}
+	}
+	extent_arr_unlock(sa->extents);
+	pthread_mutex_unlock(sa->mutex);
+
+	for(r = ranges; r < ranges + nranges; r++) {
+		for(p = r->start; p < (char *) r->end; p += n * r->pgsz) {
+			n = ((char *) r->end - p) / r->pgsz;
+			if (n > SA_MIGRATE_BATCH)
+				n = SA_MIGRATE_BATCH;
+
+			for(i = 0; i < n; i++)
+				pages[i] = p + i * r->pgsz;
+
+			if (move_pages(0, n, pages, NULL, status, 0) < 0) {
+				free(ranges);
+				return -errno;
+			}
+
+			// pages that aren't resident report -ENOENT
+			for(i = 0; i < n; i++) {
+				if (status[i] >= 0 && status[i] < nnodes)
+					sizes[status[i]] += r->pgsz;
+			}
+		}
+	}
+
+	free(ranges);
+	return 0;
+}
+
+int sicm_arena_stats(sicm_arena a, sicm_arena_statistics *st, size_t *sizes, int nnodes) {
+	sarena *sa;
+	uint64_t epoch;
+	size_t sz, page, small, large;
+	int err;
+
+	sa = a;
+	if (sa == NULL || (sizes == NULL && nnodes > 0))
+		return -EINVAL;
+
+	if (st != NULL) {
+		// refresh jemalloc's statistics
+		epoch = 1;
+		sz = sizeof(epoch);
+		err = je_mallctl("epoch", (void *) &epoch, &sz, (void *) &epoch, sz);
+		if (err != 0)
+			return -err;
+
+		sz = sizeof(size_t);
+		err = je_mallctl("arenas.page", (void *) &page, &sz, NULL, 0);
+		if (err == 0)
+			err = sa_stat(sa, "small.allocated", &small);
+		if (err == 0)
+			err = sa_stat(sa, "large.allocated", &large);
+		if (err == 0)
+			err = sa_stat(sa, "pactive", &st->active);
+		if (err == 0)
+			err = sa_stat(sa, "pdirty", &st->dirty);
+		if (err == 0)
+			err = sa_stat(sa, "pmuzzy", &st->muzzy);
+		if (err == 0)
+			err = sa_stat(sa, "resident", &st->resident);
+		if (err == 0)
+			err = sa_stat(sa, "retained", &st->retained);
+		if (err == 0)
+			err = sa_stat(sa, "mapped", &st->mapped);
+		if (err != 0)
+			return -err;
+
+		st->allocated = small + large;
+		st->active *= page;
+		st->dirty *= page;
+		st->muzzy *= page;
+	}
+
+	if (nnodes <= 0)
+		return 0;
+
+	memset(sizes, 0, nnodes * sizeof(size_t));
+	return sa_node_sizes(sa, sizes, nnodes, 0);
+}
+
+size_t sicm_arena_spilled(sicm_arena a, size_t *sizes, size_t n, size_t *peak) {
+	sarena *sa;
+	size_t i, ret;
+
+	sa = a;
+	if (sa == NULL)
+		return 0;
+
+	pthread_mutex_lock(sa->mutex);
+	ret = sa->spilled;
+	for(i = 0; i < n; i++) {
+		if (i == 0)
+			sizes[i] = sa->size - sa->spilled;
+		else if (i <= sa->fallback.count)
+			sizes[i] = sa->fallback_size[i - 1];
+		else
+			sizes[i] = 0;
+	}
+
+	if (peak != NULL)
+		*peak = sa->peak_spilled;
+	pthread_mutex_unlock(sa->mutex);
+
+	return ret;
+}
+
+int sicm_arena_set_cache(sicm_arena a, size_t max) {
+	sarena *sa;
+	sarena_cached evicted[SARENA_CACHE_EXTENTS];
+	unsigned i, n;
+
+	sa = a;
+	if (sa == NULL)
+		return -EINVAL;
+
+	// cached extents can't be unmapped while a migration may be moving them,
+	// they will be dropped when they don't fit anymore
+	n = 0;
+	pthread_rwlock_rdlock(&sa->migrate_lock);
+	pthread_mutex_lock(sa->mutex);
+	sa->max_cached = max;
+	if (sa->migration == NULL) {
+		while (sa->cached > max) {
+			evicted[n] = sa->cache[--sa->ncached];
+			sa->cached -= evicted[n].size;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(sa->mutex);
+
+	for(i = 0; i < n; i++)
+		sa_unmap(sa, evicted[i].start, evicted[i].size);
+	pthread_rwlock_unlock(&sa->migrate_lock);
+
+	return 0;
+}
+
+int sicm_arena_set_decay(sicm_arena a, ssize_t dirty_ms, ssize_t muzzy_ms) {
+	sarena *sa;
+	char str[64];
+	int err;
+
+	sa = a;
+	if (sa == NULL)
+		return -EINVAL;
+
+	snprintf(str, sizeof(str), "arena.%u.dirty_decay_ms", sa->arena_ind);
+	err = je_mallctl(str, NULL, NULL, (void *) &dirty_ms, sizeof(ssize_t));
+	if (err != 0)
+		return -err;
+
+	snprintf(str, sizeof(str), "arena.%u.muzzy_decay_ms", sa->arena_ind);
+	err = je_mallctl(str, NULL, NULL, (void *) &muzzy_ms, sizeof(ssize_t));
+	return -err;
+}
+
+int sicm_arena_get_decay(sicm_arena a, ssize_t *dirty_ms, ssize_t *muzzy_ms) {
+	sarena *sa;
+	char str[64];
+	size_t sz;
+	int err;
+
+	sa = a;
+	if (sa == NULL)
+		return -EINVAL;
+
+	sz = sizeof(ssize_t);
+	snprintf(str, sizeof(str), "arena.%u.dirty_decay_ms", sa->arena_ind);
+	err = je_mallctl(str, (void *) dirty_ms, &sz, NULL, 0);
+	if (err != 0)
+		return -err;
+
+	sz = sizeof(ssize_t);
+	snprintf(str, sizeof(str), "arena.%u.muzzy_decay_ms", sa->arena_ind);
+	err = je_mallctl(str, (void *) muzzy_ms, &sz, NULL, 0);
+	return -err;
+}
+
+int sicm_arena_purge(sicm_arena a) {
+	sarena *sa;
+	char str[32];
+
+	sa = a;
+	if (sa == NULL)
+		return -EINVAL;
+
+	snprintf(str, sizeof(str), "arena.%u.purge", sa->arena_ind);
+	return -je_mallctl(str, NULL, NULL, NULL, 0);
+}
+
+void *sicm_arena_alloc(sicm_arena a, size_t sz) {
+	sarena *sa;
+	int flags;
+
+	if (sz == 0) {
+		return je_malloc(0);
 	}
 
 	sa = a;
 	flags = 0;
 	if (sa != NULL) {
-		flags = MALLOCX_ARENA(sa->arena_ind) | MALLOCX_TCACHE_NONE;
+		flags = MALLOCX_ARENA(sa->arena_ind) | sa_tcache_flags(sa);
 	}
 
 	return je_mallocx(sz, flags);
@@ -330,7 +2321,7 @@ void *sicm_arena_alloc_aligned(sicm_arena a, size_t sz, size_t align) {
 	sa = a;
 	flags = 0;
 	if (sa != NULL)
-		flags = MALLOCX_ARENA(sa->arena_ind) | MALLOCX_TCACHE_NONE | MALLOCX_ALIGN(align);
+		flags = MALLOCX_ARENA(sa->arena_ind) | sa_tcache_flags(sa) | MALLOCX_ALIGN(align);
 
 	return je_mallocx(sz, flags);
 }
@@ -347,55 +2338,311 @@ void *sicm_arena_realloc(sicm_arena a, void *ptr, size_t sz) {
 	sa = a;
 	flags = 0;
 	if (sa != NULL)
-		flags = MALLOCX_ARENA(sa->arena_ind) | MALLOCX_TCACHE_NONE;
+		flags = MALLOCX_ARENA(sa->arena_ind) | sa_tcache_flags(sa);
 
 	return je_rallocx(ptr, sz, flags);
 }
 
+// argument of jemalloc's experimental.batch_alloc
+typedef struct sa_batch {
+	void**		ptrs;
+	size_t		num;
+	size_t		size;
+	int		flags;
+} sa_batch;
+
+size_t sicm_arena_alloc_batch(sicm_arena a, size_t sz, size_t n, void **ptrs) {
+	sarena *sa;
+	sa_batch b;
+	size_t i, filled, len;
+	int flags;
+
+	pthread_once(&sa_init, sarena_init);
+
+	sa = a;
+	flags = 0;
+	if (sa != NULL)
+		flags = MALLOCX_ARENA(sa->arena_ind) | sa_tcache_flags(sa);
+
+	// fill the batch straight from the arena's bins if jemalloc can, it
+	// may stop early (e.g. for sizes that aren't cached)
+	filled = 0;
+	if (sa_batch_miblen > 0 && sz > 0) {
+		b.ptrs = ptrs;
+		b.num = n;
+		b.size = sz;
+		b.flags = flags;
+		len = sizeof(size_t);
+		if (je_mallctlbymib(sa_batch_mib, sa_batch_miblen, &filled, &len, &b, sizeof(b)) != 0)
+			filled = 0;
+	}
+
+	for(i = filled; i < n; i++) {
+		ptrs[i] = je_mallocx(sz ? sz : 1, flags);
+		if (ptrs[i] == NULL)
+			break;
+	}
+
+	return i;
+}
+
+// arena used by sicm_alloc: the thread's default arena, or the local one
+// of its default NUMA arenas
+static sarena *sa_default_arena(void) {
+	sicm_numa_arenas *na;
+	sarena *sa;
+
+	sa = pthread_getspecific(sa_default_key);
+	if (sa == NULL) {
+		na = pthread_getspecific(sa_numa_key);
+		if (na != NULL)
+			sa = sicm_numa_arenas_local(na);
+	}
+
+	return sa;
+}
+
 void *sicm_alloc(size_t sz) {
 	sarena *sa;
 	void *ret;
 
-	sa = pthread_getspecific(sa_default_key);
+	sa = sa_default_arena();
 	if (sa != NULL)
 		ret = sicm_arena_alloc(sa, sz);
 	else
 		ret = je_malloc(sz);
 
-	return ret;
+	return ret;
+}
+
+void *sicm_alloc_aligned(size_t sz, size_t align) {
+	sarena *sa;
+	void *ret;
+
+	sa = sa_default_arena();
+	if (sa != NULL)
+		ret = sicm_arena_alloc_aligned(sa, sz, align);
+	else
+		ret = je_aligned_alloc(align, sz);
+
+	return ret;
+}
+
+void sicm_free(void *ptr) {
+	sarena *sa;
+
+	if (ptr == NULL)
+		return;
+
+	// memory from our arenas must not end up in the thread's automatic
+	// tcache, where plain je_malloc could hand it out again
+	sa = sarena_ptr2sarena(ptr);
+	if (sa != NULL)
+		je_dallocx(ptr, sa_tcache_flags(sa));
+	else
+		je_free(ptr);
+}
+
+// Sized frees skip jemalloc's size lookup. Size 0 means the size isn't
+// known, sdallocx can't be used then.
+void sicm_arena_free(sicm_arena a, void *ptr, size_t sz) {
+	sarena *sa;
+
+	if (ptr == NULL)
+		return;
+
+	sa = a;
+	if (sz == 0)
+		je_dallocx(ptr, sa != NULL ? sa_tcache_flags(sa) : 0);
+	else
+		je_sdallocx(ptr, sz, sa != NULL ? sa_tcache_flags(sa) : 0);
+}
+
+void sicm_free_sized(void *ptr, size_t sz) {
+	extent_info ext;
+
+	if (ptr == NULL)
+		return;
+
+	if (sz == 0) {
+		sicm_free(ptr);
+		return;
+	}
+
+	// the arena is still needed for its tcache flags, but only memory
+	// from our extents can belong to one of our arenas
+	pthread_once(&sa_init, sarena_init);
+	if (extent_arr_lookup(sa_extents, ptr, &ext))
+		sicm_arena_free(ext.arena, ptr, sz);
+	else
+		sicm_arena_free(sarena_ptr2sarena(ptr), ptr, sz);
+}
+
+void sicm_free_batch(void **ptrs, size_t n) {
+	extent_info ext;
+	sarena *sa;
+	size_t i;
+	int flags;
+
+	pthread_once(&sa_init, sarena_init);
+
+	// Pointers of a batch usually come from the same extent, so its arena
+	// and tcache flags are looked up only when a pointer is outside of it.
+	ext.start = ext.end = NULL;
+	sa = NULL;
+	flags = 0;
+	for(i = 0; i < n; i++) {
+		if (ptrs[i] == NULL)
+			continue;
+
+		if ((char *) ptrs[i] < (char *) ext.start || (char *) ptrs[i] >= (char *) ext.end) {
+			if (extent_arr_lookup(sa_extents, ptrs[i], &ext)) {
+				sa = ext.arena;
+				flags = sa_tcache_flags(sa);
+			} else {
+				ext.start = ext.end = NULL;
+				sa = sarena_ptr2sarena(ptrs[i]);
+				flags = sa != NULL ? sa_tcache_flags(sa) : 0;
+			}
+		}
+
+		if (sa != NULL)
+			je_dallocx(ptrs[i], flags);
+		else
+			je_free(ptrs[i]);
+	}
+}
+
+void *sicm_realloc(void *ptr, size_t sz) {
+	sarena *sa;
+
+	if (ptr == NULL)
+		return sicm_alloc(sz);
+
+	sa = sarena_ptr2sarena(ptr);
+	if (sa != NULL)
+		return sicm_arena_realloc(sa, ptr, sz);
+
+	return je_rallocx(ptr, sz, MALLOCX_TCACHE_NONE);
+}
+
+void sicm_arena_set_default(sicm_arena sa) {
+	pthread_setspecific(sa_default_key, sa);
+}
+
+sicm_arena sicm_arena_get_default(void) {
+	sicm_arena *sa;
+
+	sa = pthread_getspecific(sa_default_key);
+	return sa;
+}
+
+sicm_numa_arenas *sicm_numa_arenas_create(size_t sz, sicm_arena_flags flags, sicm_device_list *devs,
+					sicm_device_tag type, int page_size) {
+	sicm_numa_arenas *na;
+	sicm_device_list dl;
+	sicm_arena *byidx;
+	int n, d, best;
+	unsigned i, j;
+
+	pthread_once(&sa_init, sarena_init);
+
+	if (devs == NULL)
+		return NULL;
+
+	na = calloc(1, sizeof(sicm_numa_arenas));
+	if (na == NULL)
+		return NULL;
+
+	na->nnodes = numa_max_node() + 1;
+	na->bynode = calloc(na->nnodes, sizeof(sicm_arena));
+	na->arenas = calloc(devs->count, sizeof(sicm_arena));
+	byidx = calloc(devs->count, sizeof(sicm_arena));
+	if (na->bynode == NULL || na->arenas == NULL || byidx == NULL)
+		goto error;
+
+	// the device of the kind closest to each node gets an arena, shared by
+	// all nodes it is the closest device of
+	dl.count = 1;
+	for(n = 0; n < na->nnodes; n++) {
+		best = -1;
+		for(i = 0; i < devs->count; i++) {
+			if (devs->devices[i]->tag != type || sicm_device_page_size(devs->devices[i]) != page_size ||
+			    sicm_numa_id(devs->devices[i]) < 0)
+				continue;
+
+			d = numa_distance(n, sicm_numa_id(devs->devices[i]));
+			if (d > 0 && (best < 0 || d < numa_distance(n, sicm_numa_id(devs->devices[best]))))
+				best = i;
+		}
+
+		if (best < 0)
+			continue;
+
+		if (byidx[best] == NULL) {
+			dl.devices = &devs->devices[best];
+			byidx[best] = sicm_arena_create(sz, flags, &dl);
+			if (byidx[best] == NULL)
+				goto error;
+			na->arenas[na->narenas++] = byidx[best];
+		}
+		na->bynode[n] = byidx[best];
+	}
+
+	if (na->narenas == 0)
+		goto error;
+
+	free(byidx);
+	return na;
+
+error:
+	for(j = 0; j < na->narenas; j++)
+		sicm_arena_destroy(na->arenas[j]);
+	free(byidx);
+	free(na->arenas);
+	free(na->bynode);
+	free(na);
+	return NULL;
 }
 
-void *sicm_alloc_aligned(size_t sz, size_t align) {
-	sarena *sa;
-	void *ret;
+void sicm_numa_arenas_destroy(sicm_numa_arenas *na) {
+	unsigned i;
 
-	sa = pthread_getspecific(sa_default_key);
-	if (sa != NULL)
-		ret = sicm_arena_alloc_aligned(sa, sz, align);
-	else
-		ret = je_aligned_alloc(align, sz);
+	if (na == NULL)
+		return;
 
-	return ret;
-}
+	if (pthread_getspecific(sa_numa_key) == na)
+		pthread_setspecific(sa_numa_key, NULL);
 
-void sicm_free(void *ptr) {
-	je_free(ptr);
+	for(i = 0; i < na->narenas; i++)
+		sicm_arena_destroy(na->arenas[i]);
+	free(na->arenas);
+	free(na->bynode);
+	free(na);
 }
 
-void *sicm_realloc(void *ptr, size_t sz) {
-	// TODO: should we include MALLOCX_ARENA(...)???
-	return je_rallocx(ptr, sz, MALLOCX_TCACHE_NONE);
-}
+sicm_arena sicm_numa_arenas_node(sicm_numa_arenas *na, int node) {
+	if (na == NULL || node < 0 || node >= na->nnodes)
+		return NULL;
 
-void sicm_arena_set_default(sicm_arena sa) {
-	pthread_setspecific(sa_default_key, sa);
+	return na->bynode[node];
 }
 
-sicm_arena sicm_arena_get_default(void) {
-	sicm_arena *sa;
+sicm_arena sicm_numa_arenas_local(sicm_numa_arenas *na) {
+	sicm_arena sa;
+	int cpu;
 
-	sa = pthread_getspecific(sa_default_key);
-	return sa;
+	cpu = sched_getcpu();
+	sa = NULL;
+	if (cpu >= 0 && cpu < sa_ncpus && sa_cpu_node[cpu] >= 0 && sa_cpu_node[cpu] < na->nnodes)
+		sa = na->bynode[sa_cpu_node[cpu]];
+
+	return sa != NULL ? sa : na->arenas[0];
+}
+
+void sicm_numa_arenas_set_default(sicm_numa_arenas *na) {
+	pthread_once(&sa_init, sarena_init);
+	pthread_setspecific(sa_numa_key, na);
 }
 
 sarena *sarena_ptr2sarena(void *ptr) {
@@ -403,6 +2650,13 @@ sarena *sarena_ptr2sarena(void *ptr) {
 	unsigned arena_ind;
 	size_t ai_sz;
 	sarena *sa;
+	extent_info extent;
+
+	pthread_once(&sa_init, sarena_init);
+
+	// all memory of our arenas comes from sa_alloc, so try the extents first
+	if (extent_arr_lookup(sa_extents, ptr, &extent))
+		return extent.arena;
 
 	sa = NULL;
 	ai_sz = sizeof(unsigned);
@@ -412,13 +2666,7 @@ sarena *sarena_ptr2sarena(void *ptr) {
 		goto out;
 	}
 
-	// TODO: make this lookup faster if this becomes bottleneck
-	pthread_mutex_lock(&sa_mutex);
-	for(sa = sa_list; sa != NULL; sa = sa->next) {
-		if (sa->arena_ind == arena_ind)
-			break;
-	}
-	pthread_mutex_unlock(&sa_mutex);
+	sa = sa_find(arena_ind);
 
 out:
 	return sa;
@@ -433,6 +2681,8 @@ static bool sa_dalloc(extent_hooks_t *, void *, size_t, bool, unsigned);
 static void sa_destroy(extent_hooks_t *, void *, size_t, bool, unsigned);
 static bool sa_commit(extent_hooks_t *, void *, size_t, size_t, size_t, unsigned);
 static bool sa_decommit(extent_hooks_t *, void *, size_t, size_t, size_t, unsigned);
+static bool sa_purge_lazy(extent_hooks_t *, void *, size_t, size_t, size_t, unsigned);
+static bool sa_purge_forced(extent_hooks_t *, void *, size_t, size_t, size_t, unsigned);
 static bool sa_split(extent_hooks_t *, void *, size_t, size_t, size_t, bool, unsigned);
 static bool sa_merge(extent_hooks_t *, void *, size_t, void *, size_t, bool, unsigned);
 
@@ -442,174 +2692,691 @@ static extent_hooks_t sa_hooks = {
 	.destroy = sa_destroy,
 	.commit = sa_commit,
 	.decommit = sa_decommit,
-	.purge_lazy = NULL,
-	.purge_forced = NULL,
+	.purge_lazy = sa_purge_lazy,
+	.purge_forced = sa_purge_forced,
 	.split = sa_split,
 	.merge = sa_merge,
 };
 
+// copy the arena's policy into pol, whose mask must be set up by the
+// caller; should be called with sa mutex held
+static unsigned sa_policy_copy(sarena *sa, sa_policy *pol) {
+	memcpy(pol->mask, sa->nodemask->maskp, sa_mask_longs * sizeof(unsigned long));
+	pol->maxnode = sa->nodemask->size + 1;
+	pol->mpol = sa->mpol;
+	pol->nodes = sa->nodes;
+	return sa->policy_gen;
+}
+
+static int sa_mbind_node(void *addr, size_t size, int mode, int node, unsigned long maxnode, unsigned flags) {
+	unsigned long mask[sa_mask_longs];
+
+	memset(mask, 0, sizeof(mask));
+	mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	return mbind(addr, size, mode, mask, maxnode, flags);
+}
+
+static int sa_mbind_weighted(char *addr, size_t size, sa_policy *pol, unsigned shift, unsigned flags) {
+	char *start, *next, *end;
+	int node, err;
+
+	// equal weights are plain interleaving, which keeps the extent in one VMA
+	if (sa_weights_equal(pol))
+		return mbind(addr, size, MPOL_INTERLEAVE, pol->mask, pol->maxnode, flags);
+
+	// the stripe size keeps the extent within SA_WEIGHTED_MAX_RUNS runs
+	end = addr + size;
+	for(start = addr; start < end; start = next) {
+		// bind the consecutive stripes that go to the same node at once
+		node = sa_weighted_node(pol, start, shift);
+		next = sa_weighted_run_end(pol, start, end, shift);
+		err = sa_mbind_node(start, next - start, MPOL_PREFERRED, node, pol->maxnode, flags);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
+// Bind [addr, addr + size) to the arena's devices, in stripes of 1 << shift
+// bytes for SICM_ALLOC_WEIGHTED. If node isn't -1, bind it to that node
+// only: the one picked for a SICM_ALLOC_ORDERED extent, or a fallback device.
+static int sa_mbind(sarena *sa, void *addr, size_t size, sa_policy *pol, int node, unsigned shift, unsigned flags) {
+	int mode;
+
+	mode = sa->flags & SICM_ALLOC_MASK;
+	if (mode == SICM_ALLOC_ORDERED && node < 0)
+		node = sa_ordered_node(pol, size);
+
+	if (node >= 0)
+		return sa_mbind_node(addr, size, mode == SICM_ALLOC_STRICT ? MPOL_BIND : MPOL_PREFERRED, node, pol->maxnode, flags);
+
+	if (mode == SICM_ALLOC_WEIGHTED && shift != 0)
+		return sa_mbind_weighted(addr, size, pol, shift, flags);
+
+	return sa_mbind_pol(addr, size, pol, flags);
+}
+
+// bind [addr, addr + size) with the policy's mode and nodes
+static int sa_mbind_pol(void *addr, size_t size, sa_policy *pol, unsigned flags) {
+	int err;
+
+	if (pol->mpol == MPOL_DEFAULT)
+		return mbind(addr, size, MPOL_DEFAULT, NULL, 0, flags);
+
+	err = mbind(addr, size, pol->mpol, pol->mask, pol->maxnode, flags);
+
+	// MPOL_PREFERRED_MANY needs Linux 5.15, older kernels only get to
+	// prefer the first device
+	if (err < 0 && errno == EINVAL && pol->mpol == MPOL_PREFERRED_MANY)
+		err = sa_mbind_node(addr, size, MPOL_PREFERRED, pol->nodes.node[0], pol->maxnode, flags);
+
+	return err;
+}
+
+// map size bytes aligned to alignment, exactly at new_addr if it isn't NULL
+static void *sa_map(void *new_addr, size_t size, size_t alignment, int mmflags, int fd, off_t offset) {
+	void *ret, *reserve;
+	uintptr_t n, m;
+
+	ret = mmap(new_addr, size, PROT_READ | PROT_WRITE, mmflags, fd, offset);
+	if (ret == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	if ((new_addr == NULL || ret == new_addr) && (alignment == 0 || ((uintptr_t) ret)%alignment == 0)) {
+		// we are lucky and got the right address and alignment
+		return ret;
+	}
+
+	// if new_addr is set, we can't fulfill the request, so just fail
+	munmap(ret, size);
+	if (new_addr != NULL)
+		return NULL;
+
+	// reserve enough address space for an aligned extent and map it over the reservation
+	reserve = mmap(NULL, size + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (reserve == MAP_FAILED) {
+		perror("mmap2");
+		return NULL;
+	}
+
+	n = (uintptr_t) reserve;
+	m = (n + alignment - 1) & ~((uintptr_t) alignment - 1);
+	ret = mmap((void *) m, size, PROT_READ | PROT_WRITE, mmflags | MAP_FIXED, fd, offset);
+	if (ret == MAP_FAILED) {
+		perror("mmap2");
+		munmap(reserve, size + alignment);
+		return NULL;
+	}
+
+	if (m > n)
+		munmap(reserve, m - n);
+	if (n + alignment > m)
+		munmap((void *) (m + size), n + alignment - m);
+
+	return ret;
+}
+
+// Fault in [addr, addr + size). Only kernels without MADV_POPULATE_WRITE
+// (before 5.14) get the pages touched one by one: any other failure means
+// there is no memory for them (e.g. an exhausted hugetlb pool or a full
+// bound node), and touching would raise SIGBUS or wake the OOM killer.
+static int sa_populate_range(void *addr, size_t size, size_t pgsz) {
+	size_t i;
+
+	if (madvise(addr, size, MADV_POPULATE_WRITE) == 0)
+		return 0;
+	if (errno != EINVAL)
+		return -errno;
+
+	for(i = 0; i < size; i += pgsz)
+		((volatile char *) addr)[i] = 0;
+	return 0;
+}
+
+static void *sa_populate_worker(void *arg) {
+	sa_populate_work *w;
+
+	// zero the pages close to where they are
+	w = arg;
+	if (w->node >= 0)
+		numa_run_on_node(w->node);
+	w->err = sa_populate_range(w->start, w->size, w->pgsz);
+	return NULL;
+}
+
+// Fault in an anonymous extent after it was bound to the arena's nodes,
+// as set with sicm_arena_set_populate. node is the extent's node if it
+// has a single one (see sa_mbind), -1 otherwise. Returns 0, or a negative
+// errno if the memory couldn't be faulted in.
+static int sa_populate(sarena *sa, void *addr, size_t size, size_t pgsz, sa_policy *pol, int node) {
+	sa_populate_work work[SA_POPULATE_MAX_THREADS];
+	pthread_t threads[SA_POPULATE_MAX_THREADS];
+	int i, n, mode, err, started[SA_POPULATE_MAX_THREADS];
+	size_t chunk, off;
+
+	mode = __atomic_load_n(&sa->populate, __ATOMIC_RELAXED);
+	n = __atomic_load_n(&sa->populate_threads, __ATOMIC_RELAXED);
+	if (mode == SICM_POPULATE_LAZY)
+		return 0;
+
+	if (mode != SICM_POPULATE_PARALLEL || n < 2 || size < SA_POPULATE_PARALLEL_MIN)
+		return sa_populate_range(addr, size, pgsz);
+
+	chunk = sicm_div_ceil(size / pgsz, n) * pgsz;
+	for(i = 0, off = 0; i < n && off < size; i++, off += chunk) {
+		work[i].start = (char *) addr + off;
+		work[i].size = size - off < chunk ? size - off : chunk;
+		work[i].pgsz = pgsz;
+		work[i].node = node >= 0 ? node : pol->nodes.node[i % pol->nodes.count];
+		started[i] = pthread_create(&threads[i], NULL, sa_populate_worker, &work[i]) == 0;
+		if (!started[i])
+			work[i].err = sa_populate_range(work[i].start, work[i].size, pgsz);
+	}
+
+	err = 0;
+	while (--i >= 0) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (work[i].err != 0)
+			err = work[i].err;
+	}
+	return err;
+}
+
+int sicm_arena_set_populate(sicm_arena a, sicm_populate_mode mode, int nthreads) {
+	sarena *sa;
+	struct bitmask *cpus;
+
+	sa = a;
+	if (sa == NULL || mode < SICM_POPULATE_EAGER || mode > SICM_POPULATE_PARALLEL)
+		return -EINVAL;
+
+	// by default, one thread per CPU of the arena's first node
+	if (nthreads <= 0) {
+		cpus = numa_allocate_cpumask();
+		pthread_mutex_lock(sa->mutex);
+		if (numa_node_to_cpus(sa->nodes.node[0], cpus) == 0)
+			nthreads = numa_bitmask_weight(cpus);
+		pthread_mutex_unlock(sa->mutex);
+		numa_free_cpumask(cpus);
+
+		if (nthreads <= 0)
+			nthreads = sa_ncpus;
+	}
+
+	if (nthreads > SA_POPULATE_MAX_THREADS)
+		nthreads = SA_POPULATE_MAX_THREADS;
+
+	__atomic_store_n(&sa->populate_threads, nthreads, __ATOMIC_RELAXED);
+	__atomic_store_n(&sa->populate, mode, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// sicm_arena_set_devices changed the policy after we copied it, and
+// may have missed the extent while moving the others
+static void sa_rebind(sarena *sa, void *addr, size_t size, int node, unsigned shift, unsigned gen, sa_policy *pol) {
+	while (__atomic_load_n(&sa->policy_gen, __ATOMIC_ACQUIRE) != gen) {
+		pthread_mutex_lock(sa->mutex);
+		gen = sa_policy_copy(sa, pol);
+		pthread_mutex_unlock(sa->mutex);
+		sa_mbind(sa, addr, size, pol, node, shift, MPOL_MF_MOVE);
+	}
+}
+
+// mmap flags for a hugetlb mapping with pages of pgsz bytes
+static int sa_hugetlb_flags(size_t pgsz) {
+	int flags;
+
+	flags = MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+	flags |= (__builtin_ctzl(pgsz) << MAP_HUGE_SHIFT);
+#endif
+	return flags;
+}
+
+// split the extent [start, end) at mid in both indexes; lookups never miss it
+static void sa_index_split(sarena *sa, void *start, void *mid, void *end) {
+	void *val;
+
+	val = sa_extent_val(sa, start);
+	__atomic_sub_fetch(&sa->weighted_cuts, sa_weighted_cuts(start, end, sa_ext_shift(val)) -
+	                   sa_weighted_cuts(start, mid, sa_ext_shift(val)) - sa_weighted_cuts(mid, end, sa_ext_shift(val)), __ATOMIC_RELAXED);
+	extent_arr_insert(sa->extents, mid, end, val);
+	extent_arr_set_end(sa->extents, start, mid);
+	extent_arr_insert(sa_extents, mid, end, sa);
+	extent_arr_set_end(sa_extents, start, mid);
+}
+
+// Take an extent for sa_alloc from the cache, splitting off what isn't
+// needed. Should be called with sa mutex held.
+static void *sa_cache_get(sarena *sa, void *new_addr, size_t size, size_t alignment, unsigned *gen) {
+	sarena_cached *c, *best;
+	unsigned i;
+	void *ret;
+
+	best = NULL;
+	for(i = 0; i < sa->ncached; i++) {
+		c = &sa->cache[i];
+		if (c->size < size || (new_addr != NULL && c->start != new_addr))
+			continue;
+		if (alignment != 0 && ((uintptr_t) c->start) % alignment != 0)
+			continue;
+
+		if (best == NULL || c->size < best->size)
+			best = c;
+	}
+
+	if (best == NULL)
+		return NULL;
+
+	ret = best->start;
+	*gen = best->policy_gen;
+	if (best->size > size) {
+		sa_index_split(sa, ret, (char *) ret + size, (char *) ret + best->size);
+		best->start = (char *) ret + size;
+		best->size -= size;
+	} else {
+		*best = sa->cache[--sa->ncached];
+	}
+	sa->cached -= size;
+
+	return ret;
+}
+
+// keep an extent released by jemalloc, should be called with sa mutex held
+static int sa_cache_put(sarena *sa, void *start, size_t size) {
+	sarena_cached *c;
+
+	if (sa->ncached == SARENA_CACHE_EXTENTS || sa->cached + size > sa->max_cached)
+		return 0;
+
+	c = &sa->cache[sa->ncached++];
+	c->start = start;
+	c->size = size;
+	c->policy_gen = sa->policy_gen;
+	sa->cached += size;
+	return 1;
+}
+
+// Carve an extent out of a persistent arena's mapping. Its space is never
+// given back, jemalloc retains the extents instead (see sa_dalloc). Should
+// be called with sa mutex held.
+static void *sa_persist_reserve(sarena *sa, void *new_addr, size_t size, size_t alignment) {
+	sarena_persist *p;
+	uintptr_t base, start;
+
+	p = sa->persist;
+	base = (uintptr_t) p;
+	start = base + p->used;
+	if (alignment > 1)
+		start = (start + alignment - 1) & ~(alignment - 1);
+
+	if (new_addr != NULL && (uintptr_t) new_addr != start)
+		return NULL;
+
+	if (start - base > p->capacity || size > p->capacity - (start - base))
+		return NULL;
+
+	if (sa_file_grow(sa->fd, &sa->file_size, start - base + size, p->capacity) != 0)
+		return NULL;
+
+	p->used = start - base + size;
+	return (void *) start;
+}
+
 static void *sa_alloc(extent_hooks_t *h, void *new_addr, size_t size, size_t alignment, bool *zero, bool *commit, unsigned arena_ind) {
-	int mpol;
-	unsigned long *nodemaskp, maxnode;
 	sarena *sa;
-	uintptr_t n, m;
-	int oldmode, mmflags;
+	unsigned long mask[sa_mask_longs];
+	sa_policy pol;
+	unsigned gen, cgen, tier, shift;
+	int mmflags, huge, node;
+	size_t pgsz, mapsize;
+	void *val;
+	off_t offset;
 	void *ret;
-	struct bitmask *oldnodemask;
 
-	*commit = 0;
-	*zero = 0;
-	ret = NULL;
 	sa = container_of(h, sarena, hooks);
 
-	// TODO: figure out a way to prevent taking the mutex twice (sa_range_add also takes it)...
+	// extents are always committed (see sa_decommit)
+	*commit = 1;
+
+	// Reserve the space (and the range of the file, if any). Mapping and
+	// binding the extent happens without holding the mutex.
 	pthread_mutex_lock(sa->mutex);
-	if (sa->maxsize > 0 && sa->size + size > sa->maxsize) {
-		return NULL;
+
+	// hugetlb extents are rounded up to whole huge pages, jemalloc only
+	// gets to use the size it asked for
+	pgsz = sa->pgsz;
+	huge = sa->fd == -1 && pgsz > sa_page_size;
+	mapsize = size;
+	if (huge) {
+		mapsize = sicm_div_ceil(size, pgsz) * pgsz;
+		if (alignment < pgsz)
+			alignment = pgsz;
+	} else if ((sa->flags & SICM_ALLOC_THP) && size >= sa_thp_size && alignment < sa_thp_size) {
+		// THP only backs naturally aligned huge pages
+		alignment = sa_thp_size;
 	}
 
-	oldnodemask = numa_allocate_nodemask();
-	get_mempolicy(&oldmode, oldnodemask->maskp, oldnodemask->size + 1, NULL, 0);
-	switch (sa->flags & SICM_ALLOC_MASK) {
-	case SICM_ALLOC_STRICT:
-		mpol = MPOL_BIND;
-		nodemaskp = sa->nodemask->maskp;
-		maxnode = sa->nodemask->size + 1;
-		break;
+	pol.mask = mask;
+	gen = sa_policy_copy(sa, &pol);
 
-	case SICM_ALLOC_RELAXED:
-		// TODO: this will work only for single device, fix it
-		mpol = MPOL_PREFERRED;
-		nodemaskp = sa->nodemask->maskp;
-		maxnode = sa->nodemask->size + 1;
-		break;
+	// reuse an extent that is still mapped and bound, if there is one
+	if (!huge) {
+		ret = sa_cache_get(sa, new_addr, size, alignment, &cgen);
+		if (ret != NULL) {
+			pthread_mutex_unlock(sa->mutex);
+			goto cached;
+		}
+	}
 
-	default:
-		mpol = MPOL_DEFAULT;
-		nodemaskp = NULL;
-		maxnode = 0;
-		break;
+	// beyond maxsize, extents spill over to the fallback devices, if any
+	tier = 0;
+	if (sa->maxsize > 0 && sa->size - sa->spilled + mapsize > sa->maxsize) {
+		tier = sa_spill_tier(sa, mapsize);
+		if (tier == 0) {
+			pthread_mutex_unlock(sa->mutex);
+			return NULL;
+		}
 	}
 
-	if (set_mempolicy(mpol, nodemaskp, maxnode) < 0) {
-		perror("set_mempolicy");
-		goto free_nodemasks;
+	// Persistent arenas hand out parts of their mapping, other file-backed
+	// ones map the next range of the file. Offsets aren't reused, other
+	// extents may be mapped behind a released one.
+	offset = 0;
+	ret = NULL;
+	if (sa->persist != NULL) {
+		ret = sa_persist_reserve(sa, new_addr, mapsize, alignment);
+		if (ret == NULL) {
+			pthread_mutex_unlock(sa->mutex);
+			return NULL;
+		}
+	} else if (sa->fd != -1) {
+		offset = sa->file_off;
+		if (sa_file_grow(sa->fd, &sa->file_size, offset + mapsize, 0) != 0) {
+			pthread_mutex_unlock(sa->mutex);
+			return NULL;
+		}
+		sa->file_off += mapsize;
 	}
 
+	sa_account(sa, tier, mapsize, 1);
+	pthread_mutex_unlock(sa->mutex);
+
 	if (sa->fd == -1)
-		mmflags = MAP_ANONYMOUS|MAP_PRIVATE|MAP_POPULATE;
+		mmflags = MAP_ANONYMOUS|MAP_PRIVATE;
 	else
 		mmflags = MAP_SHARED;
 
-	ret = mmap(new_addr, size, PROT_READ | PROT_WRITE, mmflags, sa->fd, sa->size);
-	if (ret == MAP_FAILED) {
-		ret = NULL;
-		perror("mmap");
-		goto restore_mempolicy;
-	}
+	if (huge)
+		mmflags |= sa_hugetlb_flags(pgsz);
 
-	if (alignment == 0 || ((uintptr_t) ret)%alignment == 0) {
-		// we are lucky and got the right alignment
-		goto success;
+	if (sa->persist == NULL) {
+		ret = sa_map(new_addr, mapsize, alignment, mmflags, sa->fd, offset);
+		if (ret == NULL)
+			goto unreserve;
 	}
 
-	// the alignment didn't work out, munmap and try again
-	munmap(ret, size);
-	ret = NULL;
+	if (huge)
+		extent_arr_insert(sa->huge_extents, ret, (char *)ret + mapsize, (void *) pgsz);
 
-	// if new_addr is set, we can't fulfill the alignment, so just fail
-	if (new_addr != NULL)
-		goto restore_mempolicy;
+	// the stripe size depends on where the extent ended up
+	shift = 0;
+	if ((sa->flags & SICM_ALLOC_MASK) == SICM_ALLOC_WEIGHTED && tier == 0) {
+		pthread_mutex_lock(sa->mutex);
+		shift = sa_weighted_shift(sa, ret, (char *)ret + mapsize, huge ? pgsz : sa_page_size);
+		__atomic_add_fetch(&sa->weighted_cuts, sa_weighted_cuts(ret, (char *)ret + mapsize, shift), __ATOMIC_RELAXED);
+		pthread_mutex_unlock(sa->mutex);
+	}
 
-	size += alignment;
-	ret = mmap(NULL, size, PROT_READ | PROT_WRITE, mmflags, sa->fd, sa->size);
-	if (ret == MAP_FAILED) {
-		perror("mmap2");
-		ret = NULL;
-		goto restore_mempolicy;
+	node = sa_tier_node(sa, tier);
+	if (sa_mbind(sa, ret, mapsize, &pol, node, shift, MPOL_MF_MOVE) < 0) {
+		perror("mbind");
+		extent_arr_delete(sa->huge_extents, ret);
+		if (sa->persist == NULL)
+			munmap(ret, mapsize);
+		goto unstripe;
 	}
 
-	n = (uintptr_t) ret;
-	m = n + alignment - (n%alignment);
-	munmap(ret, m-n);
-	ret = (void *) m;
+#ifdef MADV_HUGEPAGE
+	if (!huge && (sa->flags & SICM_ALLOC_THP))
+		madvise(ret, mapsize, MADV_HUGEPAGE);
+#endif
 
-success:
-	if (mbind(ret, size, mpol, nodemaskp, maxnode, MPOL_MF_MOVE) < 0) {
-		munmap(ret, size);
-		perror("mbind");
-		ret = NULL;
-		goto restore_mempolicy;
+	// fresh anonymous mappings are zeroed, and so is the part of a
+	// persistent arena's file that was never given out
+	*zero = sa->fd == -1 || sa->persist != NULL;
+
+	// populate only after mbind, so the pages land on the arena's nodes
+	if (sa->fd == -1 && sa_populate(sa, ret, mapsize, huge ? pgsz : sa_page_size, &pol, node) != 0) {
+		extent_arr_delete(sa->huge_extents, ret);
+		munmap(ret, mapsize);
+		goto unstripe;
 	}
 
 	/* Add the extent to the array of extents */
-	extent_arr_insert(sa->extents, ret, (char *)ret + size, NULL);
+	extent_arr_insert(sa->extents, ret, (char *)ret + mapsize, sa_ext_val(tier, shift));
+	extent_arr_insert(sa_extents, ret, (char *)ret + mapsize, sa);
+
+	sa_rebind(sa, ret, mapsize, node, shift, gen, &pol);
 
 	/* Call the callback on this chunk if it's set */
 	if(sicm_extent_alloc_callback) {
-		(*sicm_extent_alloc_callback)(ret, (char *)ret + size);
+		(*sicm_extent_alloc_callback)(ret, (char *)ret + mapsize);
 	}
 
-	if (sa->fd) {
-		sa->size += size;
+	return ret;
 
-		// only extend file; do not shrink
-		// FIXME: how does that make sense, Jason???
-		if (sa->size > lseek(sa->fd, 0, SEEK_END)) {
-			ftruncate(sa->fd, sa->size);
-			fsync(sa->fd);
-		}
+cached:
+	// the extent is already in the indexes, but its old contents are still there
+	if (*zero) {
+		if (sa->fd == -1)
+			madvise(ret, size, MADV_DONTNEED);
+		else
+			memset(ret, 0, size);
 	}
 
-restore_mempolicy:
-	set_mempolicy(oldmode, oldnodemask->maskp, oldnodemask->size + 1);
+	val = sa_extent_val(sa, ret);
+	node = sa_tier_node(sa, sa_ext_tier(val));
+	if (cgen != gen)
+		sa_mbind(sa, ret, size, &pol, node, sa_ext_shift(val), MPOL_MF_MOVE);
 
-free_nodemasks:
-	numa_free_nodemask(oldnodemask);
-	pthread_mutex_unlock(sa->mutex);
+	// the extent is indexed and accounted already, sa_unmap undoes that
+	if (sa->fd == -1 && sa_populate(sa, ret, size, sa_page_size, &pol, node) != 0) {
+		sa_unmap(sa, ret, size);
+		return NULL;
+	}
+
+	sa_rebind(sa, ret, size, node, sa_ext_shift(val), gen, &pol);
 
+	if (__atomic_load_n(&sa->noverrides, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(sa->mutex);
+		sa_override_apply(sa, ret, (char *) ret + size, MPOL_MF_MOVE);
+		pthread_mutex_unlock(sa->mutex);
+	}
 	return ret;
+
+unstripe:
+	__atomic_sub_fetch(&sa->weighted_cuts, sa_weighted_cuts(ret, (char *)ret + mapsize, shift), __ATOMIC_RELAXED);
+	ret = NULL;
+unreserve:
+	pthread_mutex_lock(sa->mutex);
+	sa_account(sa, tier, mapsize, 0);
+	pthread_mutex_unlock(sa->mutex);
+
+	return NULL;
 }
 
-static bool sa_dalloc(extent_hooks_t *h, void *addr, size_t size, bool committed, unsigned arena_ind) {
-	sarena *sa;
-	bool ret;
+// unmap a normal extent, should be called with migrate_lock held
+static bool sa_unmap(sarena *sa, void *addr, size_t size) {
+	void *val;
 
-	ret = false;
-	sa = container_of(h, sarena, hooks);
+	// A new mapping at the same address gets the arena's placement, so
+	// the overrides in the range go with it. Hold the mutex until they
+	// are gone, so that the mapping never runs into them.
 	pthread_mutex_lock(sa->mutex);
+	val = sa_extent_val(sa, addr);
 	extent_arr_delete(sa->extents, addr);
+	extent_arr_delete(sa_extents, addr);
 
 	if (munmap(addr, size) != 0) {
 		fprintf(stderr, "munmap failed: %p %ld\n", addr, size);
-		extent_arr_insert(sa->extents, addr, (char *)addr + size, NULL);
-		ret = true;
+		extent_arr_insert(sa->extents, addr, (char *)addr + size, val);
+		extent_arr_insert(sa_extents, addr, (char *)addr + size, sa);
+		pthread_mutex_unlock(sa->mutex);
+		return true;
+	}
+
+	// if an override can't be split, the part outside the range loses
+	// it too, rather than have it outlive the mapping
+	sa_account(sa, sa_ext_tier(val), size, 0);
+	__atomic_sub_fetch(&sa->weighted_cuts, sa_weighted_cuts(addr, (char *) addr + size, sa_ext_shift(val)), __ATOMIC_RELAXED);
+	if (sa_override_clear(sa, addr, (char *) addr + size) != 0)
+		sa_override_drop(sa, addr, (char *) addr + size);
+	pthread_mutex_unlock(sa->mutex);
+	return false;
+}
+
+static bool sa_dalloc(extent_hooks_t *h, void *addr, size_t size, bool committed, unsigned arena_ind) {
+	sarena *sa;
+	bool ret;
+
+	sa = container_of(h, sarena, hooks);
+
+	// the space of a persistent arena is only reused by jemalloc
+	if (sa->persist != NULL)
+		return true;
+
+	// The migration workers may still be moving the extent. Let jemalloc
+	// keep it as retained, the address range must not be reused for now.
+	pthread_rwlock_rdlock(&sa->migrate_lock);
+	if (sa->migration != NULL) {
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		return true;
+	}
+
+	// jemalloc splits extents at normal page boundaries, so hugetlb
+	// extents are only unmapped as a whole in sicm_arena_destroy
+	if (sa_extent_page_size(sa, addr) != sa_page_size) {
+		pthread_rwlock_unlock(&sa->migrate_lock);
+		return true;
 	}
-	sa->size -= size;
+
+	// keep the extent mapped for the next sa_alloc if there is room for it
+	pthread_mutex_lock(sa->mutex);
+	ret = sa_cache_put(sa, addr, size);
 	pthread_mutex_unlock(sa->mutex);
+	if (!ret)
+		ret = sa_unmap(sa, addr, size);
+	else
+		ret = false;
+
+	pthread_rwlock_unlock(&sa->migrate_lock);
 	return ret;
 }
 
 static void sa_destroy(extent_hooks_t *h, void *addr, size_t size, bool committed, unsigned arena_ind) {
-	sa_dalloc(h, addr, size, committed, arena_ind);
+	sarena *sa;
+
+	// the arena is going away, don't cache anything
+	sa = container_of(h, sarena, hooks);
+	if (sa_extent_page_size(sa, addr) == sa_page_size)
+		sa_unmap(sa, addr, size);
 }
 
 static bool sa_commit(extent_hooks_t *h, void *addr, size_t size, size_t offset, size_t length, unsigned arena_ind) {
-	// no support for commit/decommit
+	// decommitted pages stay mapped read/write, they will be faulted in
+	// again (on the arena's nodes) when they are touched
 	return false;
 }
 
 static bool sa_decommit(extent_hooks_t *h, void *addr, size_t size, size_t offset, size_t length, unsigned arena_ind) {
-	// no support for commit/decommit
+	sarena *sa;
+
+	// Only release the pages, don't remap them with PROT_NONE. The mapping
+	// and the mbind policy attached to it stay intact. Huge pages can't be
+	// released in parts.
+	sa = container_of(h, sarena, hooks);
+	if (sa->fd != -1 || sa_extent_page_size(sa, addr) != sa_page_size)
+		return true;
+
+	return madvise((char *) addr + offset, length, MADV_DONTNEED) != 0;
+}
+
+static bool sa_purge_lazy(extent_hooks_t *h, void *addr, size_t size, size_t offset, size_t length, unsigned arena_ind) {
+#ifdef MADV_FREE
+	sarena *sa;
+
+	// MADV_FREE only works on private anonymous memory without hugetlb
+	sa = container_of(h, sarena, hooks);
+	if (sa->fd != -1 || sa_extent_page_size(sa, addr) != sa_page_size)
+		return true;
+
+	return madvise((char *) addr + offset, length, MADV_FREE) != 0;
+#else
 	return true;
+#endif
+}
+
+static bool sa_purge_forced(extent_hooks_t *h, void *addr, size_t size, size_t offset, size_t length, unsigned arena_ind) {
+	sarena *sa;
+
+	// jemalloc expects forced purges to zero the pages, which doesn't
+	// happen for shared file mappings or partial huge pages
+	sa = container_of(h, sarena, hooks);
+	if (sa->fd != -1 || sa_extent_page_size(sa, addr) != sa_page_size)
+		return true;
+
+	return madvise((char *) addr + offset, length, MADV_DONTNEED) != 0;
 }
 
 static bool sa_split(extent_hooks_t *h, void *addr, size_t size, size_t size_a, size_t size_b, bool committed, unsigned arena_ind) {
-	// we don't really need to keep track of each extent, let's figure it out at alloc/dalloc time
+	sarena *sa;
+
+	// hugetlb extents are tracked as whole mappings
+	sa = container_of(h, sarena, hooks);
+	if (sa_extent_page_size(sa, addr) != sa_page_size)
+		return false;
+
+	sa_index_split(sa, addr, (char *) addr + size_a, (char *) addr + size);
 	return false;
 }
 
 static bool sa_merge(extent_hooks_t *h, void *addr_a, size_t size_a, void *addr_b, size_t size_b, bool committed, unsigned arena_ind) {
-	// we don't really need to keep track of each extent, let's figure it all out at alloc/dalloc time
+	sarena *sa;
+	extent_info a, b;
+	void *val;
+	unsigned shift;
+	int huge_a, huge_b;
+
+	// Parts of the same hugetlb mapping can be merged without any
+	// bookkeeping. Merging a hugetlb extent with anything else would make
+	// it impossible to unmap the result.
+	sa = container_of(h, sarena, hooks);
+	huge_a = extent_arr_lookup(sa->huge_extents, addr_a, &a);
+	huge_b = extent_arr_lookup(sa->huge_extents, addr_b, &b);
+	if (huge_a || huge_b)
+		return !(huge_a && huge_b && a.start == b.start);
+
+	// An extent can't be on the arena's devices and a fallback device at
+	// once, or have two stripe sizes. Nor may it grow beyond
+	// SA_WEIGHTED_MAX_RUNS runs.
+	val = sa_extent_val(sa, addr_a);
+	if (val != sa_extent_val(sa, addr_b))
+		return true;
+	shift = sa_ext_shift(val);
+	if (sa_weighted_cuts(addr_a, (char *) addr_b + size_b, shift) >= SA_WEIGHTED_MAX_RUNS)
+		return true;
+	__atomic_add_fetch(&sa->weighted_cuts, sa_weighted_cuts(addr_a, (char *) addr_b + size_b, shift) -
+	                   sa_weighted_cuts(addr_a, addr_b, shift) - sa_weighted_cuts(addr_b, (char *) addr_b + size_b, shift), __ATOMIC_RELAXED);
+
+	// extend a first, so that lookups never miss the merged extent
+	extent_arr_set_end(sa->extents, addr_a, (char *) addr_b + size_b);
+	extent_arr_delete(sa->extents, addr_b);
+	extent_arr_set_end(sa_extents, addr_a, (char *) addr_b + size_b);
+	extent_arr_delete(sa_extents, addr_b);
 	return false;
 }
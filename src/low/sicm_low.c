@@ -17,6 +17,9 @@
 #ifndef MAP_HUGE_SHIFT
 #include <linux/mman.h>
 #endif
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 #include "sicm_impl.h"
 
 #define X86_CPUID_MODEL_MASK        (0xf<<4)
@@ -67,11 +70,125 @@ static int sicm_device_compare(const void * lhs, const void * rhs) {
   return l->page_size - r->page_size;
 }
 
+// read one HMAT attribute of a node, 0 if the kernel doesn't export it
+static unsigned int sicm_read_perf_attr(int node, int access, const char* name) {
+  char path[128];
+  unsigned int val = 0;
+  FILE* f;
+
+  snprintf(path, sizeof(path),
+    "/sys/devices/system/node/node%d/access%d/initiators/%s", node, access, name);
+  f = fopen(path, "r");
+  if(f == NULL)
+    return 0;
+  if(fscanf(f, "%u", &val) != 1)
+    val = 0;
+  fclose(f);
+  return val;
+}
+
+static void sicm_read_perf(int node, sicm_device_perf* perf) {
+  int access;
+
+  for(access = 0; access < SICM_ACCESS_CLASSES; access++) {
+    perf[access].read_bandwidth = sicm_read_perf_attr(node, access, "read_bandwidth");
+    perf[access].write_bandwidth = sicm_read_perf_attr(node, access, "write_bandwidth");
+    perf[access].read_latency = sicm_read_perf_attr(node, access, "read_latency");
+    perf[access].write_latency = sicm_read_perf_attr(node, access, "write_latency");
+  }
+}
+
+/*
+ * Lookup tables built by sicm_init. Page sizes are powers of two, so
+ * sicm_node_table holds SICM_PAGE_SHIFTS slots per node, indexed by the
+ * log2 of the page size in KiB. sicm_node_rank orders nodes by the
+ * kernel's memory tier, or by HMAT latency without memory tiers; lower
+ * is faster, and 0 means unknown.
+ */
+#define SICM_PAGE_SHIFTS 32
+static int sicm_node_count = 0;
+static sicm_device** sicm_node_table = NULL;
+static unsigned int* sicm_node_rank = NULL;
+
+// cached sicm_capacity/sicm_avail results of one sicm_node_table slot
+typedef struct sicm_mem_snapshot {
+  unsigned int seq; // odd while capacity and avail are being written
+  size_t capacity;  // KiB
+  size_t avail;     // KiB
+  uint64_t stamp;   // CLOCK_MONOTONIC_COARSE time of the last refresh, 0 if none
+  int refreshing;   // held by the one thread that refreshes the snapshot
+} sicm_mem_snapshot;
+static sicm_mem_snapshot* sicm_mem_cache = NULL;
+
+// set rank for every node in a kernel node list such as "0-1,4"
+static void sicm_parse_nodelist(const char* list, unsigned int rank) {
+  char* end;
+  long first, last;
+
+  while(*list != '\0' && *list != '\n') {
+    first = strtol(list, &end, 10);
+    if(end == list)
+      return;
+    last = first;
+    if(*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if(end == list)
+        return;
+    }
+    for(; first <= last; first++)
+      if(first >= 0 && first < sicm_node_count)
+        sicm_node_rank[first] = rank;
+    list = *end == ',' ? end + 1 : end;
+  }
+}
+
+static void sicm_read_node_ranks(sicm_device** devices, int count) {
+  char path[128], list[256];
+  struct dirent* entry;
+  unsigned int tier;
+  DIR* dir;
+  FILE* f;
+  int i;
+
+  // memory tiers are numbered by abstract distance, fastest first
+  dir = opendir("/sys/devices/virtual/memory_tiering");
+  if(dir != NULL) {
+    while((entry = readdir(dir)) != NULL) {
+      if(sscanf(entry->d_name, "memory_tier%u", &tier) != 1)
+        continue;
+      snprintf(path, sizeof(path), "/sys/devices/virtual/memory_tiering/memory_tier%u/nodelist", tier);
+      f = fopen(path, "r");
+      if(f == NULL)
+        continue;
+      if(fgets(list, sizeof(list), f) != NULL)
+        sicm_parse_nodelist(list, tier + 1);
+      fclose(f);
+    }
+    closedir(dir);
+  }
+  for(i = 0; i < count; i++)
+    if(sicm_node_rank[devices[i]->node] == 0)
+      break;
+  if(i == count)
+    return;
+
+  // otherwise HMAT latency, but only if every node reports it
+  for(i = 0; i < count; i++) {
+    sicm_node_rank[devices[i]->node] = devices[i]->perf[SICM_ACCESS_CPU].read_latency;
+    if(sicm_node_rank[devices[i]->node] == 0)
+      break;
+  }
+  if(i < count)
+    memset(sicm_node_rank, 0, sicm_node_count * sizeof(unsigned int));
+}
+
 /* Only initialize SICM once */
 static int sicm_init_count = 0;
 static pthread_mutex_t sicm_init_count_mutex = PTHREAD_MUTEX_INITIALIZER;
 static sicm_device_list sicm_global_devices = {};
 static sicm_device *sicm_global_device_array = NULL;
+static int sicm_global_device_count = 0;
 
 /* set in sicm_init */
 struct sicm_device *sicm_default_device_ptr = NULL;
@@ -86,6 +203,7 @@ struct sicm_device_list sicm_init() {
   }
 
   // Find the number of huge page sizes
+  char *env;
   int huge_page_size_count = 0;
   DIR* dir;
   struct dirent* entry;
@@ -100,6 +218,7 @@ struct sicm_device_list sicm_init() {
   struct bitmask* non_dram_nodes = numa_bitmask_alloc(node_count);
 
   sicm_global_device_array = malloc(device_count * sizeof(struct sicm_device));
+  sicm_global_device_count = device_count;
   int* huge_page_sizes = malloc(huge_page_size_count * sizeof(int));
 
   int i, j;
@@ -114,6 +233,7 @@ struct sicm_device_list sicm_init() {
       devices[i]->tag = INVALID_TAG;
       devices[i]->node = -1;
       devices[i]->page_size = -1;
+      memset(devices[i]->backing_count, 0, sizeof(devices[i]->backing_count));
   }
 
   // Find the actual set of huge page sizes (reported in KiB)
@@ -291,12 +411,40 @@ struct sicm_device_list sicm_init() {
 
   qsort(devices, idx, sizeof(sicm_device *), sicm_device_compare);
 
+  // devices of a node are adjacent now, so read each node's attributes once
+  for(i = 0; i < idx; i++) {
+    if(i > 0 && devices[i - 1]->node == devices[i]->node)
+      memcpy(devices[i]->perf, devices[i - 1]->perf, sizeof(devices[i]->perf));
+    else
+      sicm_read_perf(devices[i]->node, devices[i]->perf);
+  }
+
+  sicm_node_count = node_count;
+  sicm_node_table = calloc(node_count * SICM_PAGE_SHIFTS, sizeof(sicm_device*));
+  sicm_node_rank = calloc(node_count, sizeof(unsigned int));
+  if(sicm_mem_cache == NULL)
+    sicm_mem_cache = calloc(node_count * SICM_PAGE_SHIFTS, sizeof(*sicm_mem_cache));
+  for(i = 0; i < idx; i++)
+    sicm_node_table[devices[i]->node * SICM_PAGE_SHIFTS + __builtin_ctz(devices[i]->page_size)] = devices[i];
+  sicm_read_node_ranks(devices, idx);
+
   sicm_global_devices = (struct sicm_device_list){ .count = idx, .devices = devices };
 
   sicm_default_device(0);
 
   sicm_init_count++;
   pthread_mutex_unlock(&sicm_init_count_mutex);
+
+  // pre-created arenas for sicm_arena_create, see sicm_arena_pool_reserve
+  env = getenv("SICM_ARENA_POOL");
+  if (env != NULL)
+    sicm_arena_pool_reserve(strtoul(env, NULL, 10));
+
+  // small-object cache in front of sicm_device_alloc, see sicm_device_cache_enable
+  env = getenv("SICM_DEVICE_CACHE");
+  if (env != NULL && atoi(env) != 0)
+    sicm_device_cache_enable();
+
   return sicm_global_devices;
 }
 
@@ -308,6 +456,97 @@ sicm_device *sicm_default_device(const unsigned int idx) {
     return sicm_default_device_ptr;
 }
 
+sicm_device *sicm_node_device(int node, int page_size) {
+  if (page_size == 0)
+    page_size = normal_page_size;
+  if (node < 0 || node >= sicm_node_count || page_size <= 0 || (page_size & (page_size - 1)))
+    return NULL;
+  return sicm_node_table[node * SICM_PAGE_SHIFTS + __builtin_ctz(page_size)];
+}
+
+// tier order of two nodes as seen from initiator: rank, then SLIT distance
+static int sicm_tier_cmp(int initiator, int a, int b) {
+  if (sicm_node_rank[a] != sicm_node_rank[b])
+    return sicm_node_rank[a] < sicm_node_rank[b] ? -1 : 1;
+  return numa_distance(initiator, a) - numa_distance(initiator, b);
+}
+
+sicm_tier_list sicm_device_tiers(int initiator) {
+  sicm_tier_list tl = { 0, NULL };
+  sicm_device_list* tier = NULL;
+  sicm_device** devs;
+  int *nodes, nnodes, i, j, n;
+  unsigned int k;
+
+  if (initiator < 0)
+    initiator = numa_node_of_cpu(sched_getcpu());
+
+  nodes = malloc(sicm_node_count * sizeof(int));
+  tl.tiers = calloc(sicm_node_count, sizeof(sicm_device_list));
+  if (nodes == NULL || tl.tiers == NULL) {
+    free(nodes);
+    free(tl.tiers);
+    tl.tiers = NULL;
+    return tl;
+  }
+
+  // nodes with devices, sorted by tier order
+  nnodes = 0;
+  for (n = 0; n < sicm_node_count; n++) {
+    for (j = 0; j < SICM_PAGE_SHIFTS; j++)
+      if (sicm_node_table[n * SICM_PAGE_SHIFTS + j] != NULL)
+        break;
+    if (j == SICM_PAGE_SHIFTS)
+      continue;
+    for (i = nnodes; i > 0 && sicm_tier_cmp(initiator, n, nodes[i - 1]) < 0; i--)
+      nodes[i] = nodes[i - 1];
+    nodes[i] = n;
+    nnodes++;
+  }
+
+  // nodes that compare equal share a tier
+  for (i = 0; i < nnodes; i++) {
+    if (i == 0 || sicm_tier_cmp(initiator, nodes[i - 1], nodes[i]) != 0)
+      tier = &tl.tiers[tl.count++];
+    for (k = 0; k < sicm_global_devices.count; k++) {
+      if (sicm_global_devices.devices[k]->node != nodes[i])
+        continue;
+      devs = realloc(tier->devices, (tier->count + 1) * sizeof(sicm_device*));
+      if (devs == NULL)
+        continue;
+      tier->devices = devs;
+      tier->devices[tier->count++] = sicm_global_devices.devices[k];
+    }
+  }
+
+  free(nodes);
+  return tl;
+}
+
+int sicm_device_tier(sicm_tier_list *tiers, sicm_device *device) {
+  unsigned int i, j;
+
+  if (tiers == NULL)
+    return -1;
+  for (i = 0; i < tiers->count; i++)
+    for (j = 0; j < tiers->tiers[i].count; j++)
+      if (tiers->tiers[i].devices[j] == device)
+        return i;
+  return -1;
+}
+
+void sicm_tier_list_free(sicm_tier_list *tiers) {
+  unsigned int i;
+
+  if (tiers == NULL)
+    return;
+  for (i = 0; i < tiers->count; i++)
+    free(tiers->tiers[i].devices);
+  free(tiers->tiers);
+  tiers->tiers = NULL;
+  tiers->count = 0;
+}
+
 /* Frees memory up */
 void sicm_fini() {
   pthread_mutex_lock(&sicm_init_count_mutex);
@@ -316,6 +555,11 @@ void sicm_fini() {
       if (sicm_init_count == 0) {
           free(sicm_global_devices.devices);
           free(sicm_global_device_array);
+          free(sicm_node_table);
+          free(sicm_node_rank);
+          sicm_node_table = NULL;
+          sicm_node_rank = NULL;
+          sicm_node_count = 0;
           memset(&sicm_global_devices, 0, sizeof(sicm_global_devices));
       }
   }
@@ -345,37 +589,291 @@ sicm_device *sicm_find_device(sicm_device_list *devs, const sicm_device_tag type
     return dev;
 }
 
-void* sicm_device_alloc(struct sicm_device* device, size_t size) {
+// Reserved hugetlb pages, bound to the device's node.
+static void* sicm_alloc_hugetlb(struct sicm_device* device, size_t size) {
+  int shift = 10; // i.e., 1024
+  int remaining = sicm_device_page_size(device);
+  while(remaining > 1) {
+    shift++;
+    remaining >>= 1;
+  }
+  int old_mode;
+  nodemask_t old_nodemask;
+  get_mempolicy(&old_mode, old_nodemask.n, numa_max_node() + 2, NULL, 0);
+  nodemask_t nodemask;
+  nodemask_zero(&nodemask);
+  nodemask_set_compat(&nodemask, sicm_numa_id(device));
+  set_mempolicy(MPOL_BIND, nodemask.n, numa_max_node() + 2);
+  void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+  set_mempolicy(old_mode, old_nodemask.n, numa_max_node() + 2);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Anonymous memory aligned to and sized in huge pages, so sicm_device_free
+// can unmap it like a hugetlb allocation. With thp set, it is advised for
+// transparent huge pages; this fails if THP is disabled.
+static void* sicm_alloc_aligned_anon(struct sicm_device* device, size_t size, int thp) {
+  size_t huge = (size_t)sicm_device_page_size(device) * 1024;
+  size_t len = sicm_div_ceil(size, huge) * huge;
+  char* raw = mmap(NULL, len + huge, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(raw == MAP_FAILED)
+    return NULL;
+
+  // trim the slack on both sides of the aligned range
+  char* ptr = (char*)(((uintptr_t)raw + huge - 1) & ~(uintptr_t)(huge - 1));
+  if(ptr > raw)
+    munmap(raw, ptr - raw);
+  if(ptr + len < raw + len + huge)
+    munmap(ptr + len, raw + huge - ptr);
+
+  nodemask_t nodemask;
+  nodemask_zero(&nodemask);
+  nodemask_set_compat(&nodemask, sicm_numa_id(device));
+  if((thp && madvise(ptr, len, MADV_HUGEPAGE) != 0) ||
+     mbind(ptr, len, MPOL_BIND, nodemask.n, numa_max_node() + 2, 0) != 0) {
+    munmap(ptr, len);
+    return NULL;
+  }
+  return ptr;
+}
+
+/*
+ * Optional size-class cache for small device allocations. Each device
+ * has one depot per size class, which carves objects out of slabs
+ * obtained from the device and keeps a list of freed objects. Threads
+ * move objects between the depots and their own magazines in batches,
+ * so most small allocations and frees don't take a lock or make a
+ * system call. Slabs are never given back to the device.
+ */
+#define SICM_CACHE_MIN_SHIFT 4                  // smallest class is 16 bytes
+#define SICM_CACHE_CLASSES   8                  // largest class is 2 KiB
+#define SICM_CACHE_MAX_SIZE  ((size_t)1 << (SICM_CACHE_MIN_SHIFT + SICM_CACHE_CLASSES - 1))
+#define SICM_CACHE_SLAB_SIZE ((size_t)2 << 20)  // devices with larger pages aren't cached
+#define SICM_CACHE_MAG_SIZE  64
+
+typedef struct sicm_cache_depot {
+  pthread_mutex_t mutex;
+  void* free;           // freed objects, linked through their first word
+  char* bump;           // unused part of the newest slab
+  char* bump_end;
+  sicm_backing backing; // worst backing of any slab of the depot
+} sicm_cache_depot;
+
+typedef struct sicm_cache_mag {
+  unsigned int count;
+  void* objs[SICM_CACHE_MAG_SIZE];
+} sicm_cache_mag;
+
+// A thread's magazines, indexed by device index * SICM_CACHE_CLASSES + class
+typedef struct sicm_cache_thread {
+  size_t count;
+  sicm_cache_mag** mags;
+} sicm_cache_thread;
+
+static int sicm_cache_on = 0;
+static pthread_mutex_t sicm_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sicm_cache_depot* sicm_cache_depots = NULL;
+static size_t sicm_cache_ndepots = 0;
+static extent_arr* sicm_cache_slabs = NULL; // slabs of all depots, arena is the depot index + 1
+static pthread_key_t sicm_cache_key;
+
+// depot index for an allocation, or -1 if it isn't cached
+static ssize_t sicm_cache_index(struct sicm_device* device, size_t size) {
+  uintptr_t base = (uintptr_t)sicm_global_device_array;
+  uintptr_t dev = (uintptr_t)device;
+  size_t idx;
+  unsigned int cls;
+
+  if(!__atomic_load_n(&sicm_cache_on, __ATOMIC_ACQUIRE) || size > SICM_CACHE_MAX_SIZE)
+    return -1;
+  if(dev < base || dev >= base + sicm_global_device_count * sizeof(struct sicm_device))
+    return -1;
+  if((size_t)sicm_device_page_size(device) * 1024 > SICM_CACHE_SLAB_SIZE)
+    return -1;
+
+  idx = (dev - base) / sizeof(struct sicm_device);
+  cls = 0;
+  if(size > ((size_t)1 << SICM_CACHE_MIN_SHIFT))
+    cls = sizeof(long) * 8 - __builtin_clzl(size - 1) - SICM_CACHE_MIN_SHIFT;
+  idx = idx * SICM_CACHE_CLASSES + cls;
+  return idx < sicm_cache_ndepots ? (ssize_t)idx : -1;
+}
+
+static size_t sicm_cache_class_size(size_t idx) {
+  return (size_t)1 << (SICM_CACHE_MIN_SHIFT + idx % SICM_CACHE_CLASSES);
+}
+
+// move up to n objects from the depot into objs, returns how many were moved
+static unsigned int sicm_cache_take(size_t idx, void** objs, unsigned int n, sicm_backing* backing) {
+  sicm_cache_depot* depot = &sicm_cache_depots[idx];
+  struct sicm_device* device = &sicm_global_device_array[idx / SICM_CACHE_CLASSES];
+  size_t objsize = sicm_cache_class_size(idx);
+  unsigned int i = 0;
+  sicm_backing got;
+  char* slab;
+
+  pthread_mutex_lock(&depot->mutex);
+  while(i < n && depot->free != NULL) {
+    objs[i] = depot->free;
+    depot->free = *(void**)objs[i];
+    i++;
+  }
+  if(i == 0 && depot->bump == depot->bump_end) {
+    slab = sicm_device_alloc_backing(device, SICM_CACHE_SLAB_SIZE, &got);
+    if(slab != NULL) {
+      extent_arr_insert(sicm_cache_slabs, slab, slab + SICM_CACHE_SLAB_SIZE, (void*)(uintptr_t)(idx + 1));
+      depot->bump = slab;
+      depot->bump_end = slab + SICM_CACHE_SLAB_SIZE;
+      if(got > depot->backing)
+        depot->backing = got;
+    }
+  }
+  while(i < n && depot->bump != depot->bump_end) {
+    objs[i++] = depot->bump;
+    depot->bump += objsize;
+  }
+  if(backing)
+    *backing = depot->backing;
+  pthread_mutex_unlock(&depot->mutex);
+  return i;
+}
+
+// return n objects to the depot
+static void sicm_cache_put(size_t idx, void** objs, unsigned int n) {
+  sicm_cache_depot* depot = &sicm_cache_depots[idx];
+  unsigned int i;
+
+  if(n == 0)
+    return;
+  for(i = 0; i + 1 < n; i++)
+    *(void**)objs[i] = objs[i + 1];
+  pthread_mutex_lock(&depot->mutex);
+  *(void**)objs[n - 1] = depot->free;
+  depot->free = objs[0];
+  pthread_mutex_unlock(&depot->mutex);
+}
+
+static void sicm_cache_thread_fini(void* arg) {
+  sicm_cache_thread* ct = arg;
+  size_t i;
+
+  for(i = 0; i < ct->count; i++) {
+    if(ct->mags[i] != NULL) {
+      sicm_cache_put(i, ct->mags[i]->objs, ct->mags[i]->count);
+      free(ct->mags[i]);
+    }
+  }
+  free(ct->mags);
+  free(ct);
+}
+
+// the calling thread's magazine for a depot, or NULL if it can't be created
+static sicm_cache_mag* sicm_cache_mag_get(size_t idx) {
+  sicm_cache_thread* ct;
+
+  ct = pthread_getspecific(sicm_cache_key);
+  if(ct == NULL) {
+    ct = calloc(1, sizeof(sicm_cache_thread));
+    if(ct == NULL)
+      return NULL;
+    ct->mags = calloc(sicm_cache_ndepots, sizeof(sicm_cache_mag*));
+    if(ct->mags == NULL) {
+      free(ct);
+      return NULL;
+    }
+    ct->count = sicm_cache_ndepots;
+    pthread_setspecific(sicm_cache_key, ct);
+  }
+  if(ct->mags[idx] == NULL)
+    ct->mags[idx] = calloc(1, sizeof(sicm_cache_mag));
+  return ct->mags[idx];
+}
+
+static void* sicm_cache_alloc(size_t idx, sicm_backing* backing) {
+  sicm_cache_mag* mag = sicm_cache_mag_get(idx);
+  void* ptr;
+
+  if(mag == NULL)
+    return sicm_cache_take(idx, &ptr, 1, backing) ? ptr : NULL;
+  if(mag->count == 0)
+    mag->count = sicm_cache_take(idx, mag->objs, SICM_CACHE_MAG_SIZE / 2, NULL);
+  if(mag->count == 0)
+    return NULL;
+  if(backing)
+    *backing = sicm_cache_depots[idx].backing;
+  return mag->objs[--mag->count];
+}
+
+static void sicm_cache_free(size_t idx, void* ptr) {
+  sicm_cache_mag* mag = sicm_cache_mag_get(idx);
+
+  if(mag == NULL) {
+    sicm_cache_put(idx, &ptr, 1);
+    return;
+  }
+  if(mag->count == SICM_CACHE_MAG_SIZE) {
+    mag->count -= SICM_CACHE_MAG_SIZE / 2;
+    sicm_cache_put(idx, &mag->objs[mag->count], SICM_CACHE_MAG_SIZE / 2);
+  }
+  mag->objs[mag->count++] = ptr;
+}
+
+int sicm_device_cache_enable(void) {
+  size_t i, n;
+
+  pthread_mutex_lock(&sicm_cache_mutex);
+  if(sicm_cache_depots == NULL) {
+    n = (size_t)sicm_global_device_count * SICM_CACHE_CLASSES;
+    if(n == 0 || (sicm_cache_depots = calloc(n, sizeof(sicm_cache_depot))) == NULL) {
+      pthread_mutex_unlock(&sicm_cache_mutex);
+      return -ENOMEM;
+    }
+    sicm_cache_slabs = extent_arr_init();
+    for(i = 0; i < n; i++)
+      pthread_mutex_init(&sicm_cache_depots[i].mutex, NULL);
+    sicm_cache_ndepots = n;
+    pthread_key_create(&sicm_cache_key, sicm_cache_thread_fini);
+  }
+  __atomic_store_n(&sicm_cache_on, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&sicm_cache_mutex);
+  return 0;
+}
+
+void* sicm_device_alloc_backing(struct sicm_device* device, size_t size, sicm_backing* backing) {
+  void* ptr = NULL;
+  sicm_backing got = SICM_BACKING_NORMAL;
+  ssize_t idx;
+
+  idx = sicm_cache_index(device, size);
+  if(idx >= 0)
+    return sicm_cache_alloc(idx, backing);
+
   switch(device->tag) {
     case SICM_DRAM:
     case SICM_KNL_HBM:
     case SICM_OPTANE:
-    case SICM_POWERPC_HBM:; // labels can't be followed by declarations
-      int page_size = sicm_device_page_size(device);
-      if(page_size == normal_page_size)
-        return numa_alloc_onnode(size, sicm_numa_id(device));
+    case SICM_POWERPC_HBM:
+      if(sicm_device_page_size(device) == normal_page_size) {
+        ptr = numa_alloc_onnode(size, sicm_numa_id(device));
+      }
+      else if((ptr = sicm_alloc_hugetlb(device, size)) != NULL) {
+        got = SICM_BACKING_HUGETLB;
+      }
+      else if((ptr = sicm_alloc_aligned_anon(device, size, 1)) != NULL) {
+        got = SICM_BACKING_THP;
+      }
       else {
-        int shift = 10; // i.e., 1024
-        int remaining = page_size;
-        while(remaining > 1) {
-          shift++;
-          remaining >>= 1;
-        }
-        int old_mode;
-        nodemask_t old_nodemask;
-        get_mempolicy(&old_mode, old_nodemask.n, numa_max_node() + 2, NULL, 0);
-        nodemask_t nodemask;
-        nodemask_zero(&nodemask);
-        nodemask_set_compat(&nodemask, sicm_numa_id(device));
-        set_mempolicy(MPOL_BIND, nodemask.n, numa_max_node() + 2);
-        void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
-          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
-        if(ptr == MAP_FAILED) {
-          printf("huge page allocation error: %s\n", strerror(errno));
-        }
-        set_mempolicy(old_mode, old_nodemask.n, numa_max_node() + 2);
-        return ptr;
+        ptr = sicm_alloc_aligned_anon(device, size, 0);
       }
+
+      if(ptr == NULL)
+        return NULL;
+      __atomic_fetch_add(&device->backing_count[got], 1, __ATOMIC_RELAXED);
+      if(backing)
+        *backing = got;
+      return ptr;
     case INVALID_TAG:
       break;
   }
@@ -383,6 +881,16 @@ void* sicm_device_alloc(struct sicm_device* device, size_t size) {
   exit(-1);
 }
 
+void* sicm_device_alloc(struct sicm_device* device, size_t size) {
+  return sicm_device_alloc_backing(device, size, NULL);
+}
+
+size_t sicm_device_backing_count(struct sicm_device* device, sicm_backing backing) {
+  if(device == NULL || backing < 0 || backing >= SICM_BACKING_COUNT)
+    return 0;
+  return __atomic_load_n(&device->backing_count[backing], __ATOMIC_RELAXED);
+}
+
 void* sicm_device_alloc_mmapped(struct sicm_device* device, size_t size, int fd, off_t offset) {
   switch(device->tag) {
     case SICM_DRAM:
@@ -488,6 +996,17 @@ void* sicm_alloc_exact(struct sicm_device* device, void* base, size_t size) {
 }
 
 void sicm_device_free(struct sicm_device* device, void* ptr, size_t size) {
+  extent_info slab;
+
+  // Only objects carved out of a slab go back to the cache. Small
+  // mappings of the device, or ones made before the cache was enabled,
+  // are unmapped as usual.
+  if(size <= SICM_CACHE_MAX_SIZE && __atomic_load_n(&sicm_cache_on, __ATOMIC_ACQUIRE) &&
+     extent_arr_lookup(sicm_cache_slabs, ptr, &slab)) {
+    sicm_cache_free((uintptr_t)slab.arena - 1, ptr);
+    return;
+  }
+
   switch(device->tag) {
     case SICM_DRAM:
     case SICM_KNL_HBM:
@@ -510,6 +1029,18 @@ void sicm_device_free(struct sicm_device* device, void* ptr, size_t size) {
   }
 }
 
+int sicm_device_get_perf(struct sicm_device* device, sicm_access_class access, sicm_device_perf* perf) {
+  sicm_device_perf* p;
+
+  if(device == NULL || perf == NULL || access < 0 || access >= SICM_ACCESS_CLASSES)
+    return -EINVAL;
+  p = &device->perf[access];
+  if(!p->read_bandwidth && !p->write_bandwidth && !p->read_latency && !p->write_latency)
+    return -ENODATA;
+  *perf = *p;
+  return 0;
+}
+
 int sicm_numa_id(struct sicm_device* device) {
     return device?device->node:-1;
 }
@@ -587,102 +1118,152 @@ int sicm_pin(struct sicm_device* device) {
   return ret;
 }
 
-size_t sicm_capacity(struct sicm_device* device) {
-  static const size_t path_len = 100;
-  char path[path_len];
-  int i;
+/*
+ * sicm_capacity and sicm_avail serve snapshots of each (node, page size)
+ * slot of sicm_node_table. A snapshot older than the refresh interval is
+ * re-read by whichever caller notices first; everyone else keeps reading
+ * the previous values without locking or system calls.
+ */
+static uint64_t sicm_mem_interval = 10000000; // ns
+
+static uint64_t sicm_coarse_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// read capacity and available memory of a device in KiB from sysfs
+static int sicm_read_mem(struct sicm_device* device, size_t* capacity, size_t* avail) {
+  char path[128], line[128], field[32];
+  size_t val, pages;
+  int node, page_size, found;
+  FILE* f;
+
   switch(device->tag) {
     case SICM_DRAM:
     case SICM_KNL_HBM:
     case SICM_OPTANE:
-    case SICM_POWERPC_HBM:;
-      int node = sicm_numa_id(device);
-      int page_size = sicm_device_page_size(device);
-      if(page_size == normal_page_size) {
-        snprintf(path, path_len, "/sys/devices/system/node/node%d/meminfo", node);
-        int fd = open(path, O_RDONLY);
-        char data[31];
-        if (read(fd, data, 31) != 31) {
-            close(fd);
-            return -1;
-        }
-        close(fd);
-        size_t res = 0;
-        size_t factor = 1;
-        for(i = 30; data[i] != ' '; i--) {
-          res += factor * (data[i] - '0');
-          factor *= 10;
-        }
-        return res;
-      }
-      else {
-        snprintf(path, path_len, "/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/nr_hugepages", node, page_size);
-        int fd = open(path, O_RDONLY);
-        int pages = 0;
-        char data[10];
-        while(read(fd, data, 10) > 0) {
-          for(i = 0; i < 10; i++) {
-            if(data[i] < '0' || data[i] > '9') break;
-            pages *= 10;
-            pages += data[i] - '0';
-          }
-        }
-        close(fd);
-        return pages * page_size;
-      }
+    case SICM_POWERPC_HBM:
+      break;
     case INVALID_TAG:
     default:
       return -1;
   }
-}
 
-size_t sicm_avail(struct sicm_device* device) {
-  static const size_t path_len = 100;
-  char path[path_len];
-  int i;
-  switch(device->tag) {
-    case SICM_DRAM:
-    case SICM_KNL_HBM:
-    case SICM_OPTANE:
-    case SICM_POWERPC_HBM:;
-      int node = sicm_numa_id(device);
-      int page_size = sicm_device_page_size(device);
-      if(page_size == normal_page_size) {
-        snprintf(path, path_len, "/sys/devices/system/node/node%d/meminfo", node);
-        int fd = open(path, O_RDONLY);
-        char data[66];
-        if (read(fd, data, 66) != 66) {
-            close(fd);
-            return -1;
-        }
-        close(fd);
-        size_t res = 0;
-        size_t factor = 1;
-        for(i = 65; data[i] != ' '; i--) {
-          res += factor * (data[i] - '0');
-          factor *= 10;
-        }
-        return res;
+  node = sicm_numa_id(device);
+  page_size = sicm_device_page_size(device);
+  if(page_size == normal_page_size) {
+    // lines look like "Node 0 MemFree:        1234 kB"
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/meminfo", node);
+    f = fopen(path, "r");
+    if(f == NULL)
+      return -1;
+    found = 0;
+    while(found != 3 && fgets(line, sizeof(line), f) != NULL) {
+      if(sscanf(line, "Node %*d %31[^:]: %zu", field, &val) != 2)
+        continue;
+      if(strcmp(field, "MemTotal") == 0) {
+        *capacity = val;
+        found |= 1;
       }
-      else {
-        snprintf(path, path_len, "/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/free_hugepages", node, page_size);
-        int fd = open(path, O_RDONLY);
-        int pages = 0;
-        char data[10];
-        while(read(fd, data, 10) > 0) {
-          for(i = 0; i < 10; i++) {
-            if(data[i] < '0' || data[i] > '9') break;
-            pages *= 10;
-            pages += data[i] - '0';
-          }
-        }
-        close(fd);
-        return pages * page_size;
+      else if(strcmp(field, "MemFree") == 0) {
+        *avail = val;
+        found |= 2;
       }
-    case INVALID_TAG:
-    default:
-      return -1;
+    }
+    fclose(f);
+    return found == 3 ? 0 : -1;
   }
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/nr_hugepages", node, page_size);
+  f = fopen(path, "r");
+  if(f == NULL)
+    return -1;
+  found = fscanf(f, "%zu", &pages) == 1;
+  fclose(f);
+  if(!found)
+    return -1;
+  *capacity = pages * page_size;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/free_hugepages", node, page_size);
+  f = fopen(path, "r");
+  if(f == NULL)
+    return -1;
+  found = fscanf(f, "%zu", &pages) == 1;
+  fclose(f);
+  if(!found)
+    return -1;
+  *avail = pages * page_size;
+  return 0;
+}
+
+static int sicm_mem_query(struct sicm_device* device, size_t* capacity, size_t* avail) {
+  sicm_mem_snapshot* snap;
+  uint64_t now, stamp, interval;
+  unsigned int seq;
+  size_t c, a;
+  int node = sicm_numa_id(device), page_size = sicm_device_page_size(device);
+
+  interval = __atomic_load_n(&sicm_mem_interval, __ATOMIC_RELAXED);
+  if(interval == 0 || sicm_mem_cache == NULL || node < 0 || node >= sicm_node_count ||
+     page_size <= 0 || (page_size & (page_size - 1)))
+    return sicm_read_mem(device, capacity, avail);
+  snap = &sicm_mem_cache[node * SICM_PAGE_SHIFTS + __builtin_ctz(page_size)];
+
+  now = sicm_coarse_ns();
+  stamp = __atomic_load_n(&snap->stamp, __ATOMIC_ACQUIRE);
+  if(stamp == 0 || now - stamp >= interval) {
+    if(!__atomic_exchange_n(&snap->refreshing, 1, __ATOMIC_ACQUIRE)) {
+      if(sicm_read_mem(device, &c, &a) == 0) {
+        // publish both values under the sequence count
+        seq = __atomic_load_n(&snap->seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&snap->capacity, c, __ATOMIC_RELAXED);
+        __atomic_store_n(&snap->avail, a, __ATOMIC_RELAXED);
+        __atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+        __atomic_store_n(&snap->stamp, now | 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&snap->refreshing, 0, __ATOMIC_RELEASE);
+        *capacity = c;
+        *avail = a;
+        return 0;
+      }
+      __atomic_store_n(&snap->refreshing, 0, __ATOMIC_RELEASE);
+    }
+    // nothing cached yet and another thread is reading it
+    if(stamp == 0)
+      return sicm_read_mem(device, capacity, avail);
+  }
+
+  // retry while the values are being written, so they belong together
+  do {
+    seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+    c = __atomic_load_n(&snap->capacity, __ATOMIC_RELAXED);
+    a = __atomic_load_n(&snap->avail, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while((seq & 1) || __atomic_load_n(&snap->seq, __ATOMIC_RELAXED) != seq);
+
+  *capacity = c;
+  *avail = a;
+  return 0;
+}
+
+void sicm_capacity_refresh_interval(unsigned int usec) {
+  __atomic_store_n(&sicm_mem_interval, (uint64_t)usec * 1000, __ATOMIC_RELAXED);
+}
+
+size_t sicm_capacity(struct sicm_device* device) {
+  size_t capacity, avail;
+  if(sicm_mem_query(device, &capacity, &avail) != 0)
+    return -1;
+  return capacity;
+}
+
+size_t sicm_avail(struct sicm_device* device) {
+  size_t capacity, avail;
+  if(sicm_mem_query(device, &capacity, &avail) != 0)
+    return -1;
+  return avail;
 }
 
 int sicm_model_distance(struct sicm_device* device) {
@@ -749,6 +1330,146 @@ void sicm_latency(struct sicm_device* device, size_t size, int iter, struct sicm
   res->free = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
 }
 
+#define SICM_LINE_SIZE 64
+
+// 64-bit random number from two steps of sicm_rand
+static uint64_t sicm_rand64(unsigned int* n) {
+  uint64_t hi, lo;
+  sicm_rand(*n);
+  hi = *n;
+  sicm_rand(*n);
+  lo = *n;
+  return (hi << 32) | lo;
+}
+
+double sicm_latency_chase(struct sicm_device* device, int initiator, size_t size, size_t iter) {
+  struct bitmask* cpus = NULL;
+  struct timespec start, end;
+  sicm_backing backing;
+  size_t lines, i, j, tmp;
+  unsigned int n = time(NULL) | 1;
+  void** p;
+  char* blob;
+  double res = -1;
+
+  lines = size / SICM_LINE_SIZE;
+  if(lines < 2 || iter == 0)
+    return -1;
+
+  if(initiator >= 0) {
+    cpus = numa_allocate_cpumask();
+    numa_sched_getaffinity(0, cpus);
+    if(numa_run_on_node(initiator) != 0)
+      goto out;
+  }
+
+  blob = sicm_device_alloc_backing(device, size, &backing);
+  if(blob == NULL)
+    goto out;
+  // keep TLB misses out of the numbers where the kernel allows it
+  if(backing == SICM_BACKING_NORMAL)
+    madvise(blob, size, MADV_HUGEPAGE);
+
+  // Sattolo's algorithm turns the identity into a single random cycle
+  // through all lines, so every load depends on the one before it.
+  for(i = 0; i < lines; i++)
+    *(size_t*)(blob + i * SICM_LINE_SIZE) = i;
+  for(i = lines - 1; i > 0; i--) {
+    j = sicm_rand64(&n) % i;
+    tmp = *(size_t*)(blob + i * SICM_LINE_SIZE);
+    *(size_t*)(blob + i * SICM_LINE_SIZE) = *(size_t*)(blob + j * SICM_LINE_SIZE);
+    *(size_t*)(blob + j * SICM_LINE_SIZE) = tmp;
+  }
+  for(i = 0; i < lines; i++) {
+    p = (void**)(blob + i * SICM_LINE_SIZE);
+    *p = blob + *(size_t*)p * SICM_LINE_SIZE;
+  }
+
+  // one lap to warm the TLB and the paging structures
+  p = (void**)blob;
+  for(i = 0; i < lines; i++)
+    p = *(void* volatile*)p;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  for(i = 0; i < iter; i++)
+    p = *(void* volatile*)p;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  res = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iter;
+
+  sicm_device_free(device, blob, size);
+out:
+  if(cpus != NULL) {
+    numa_sched_setaffinity(0, cpus);
+    numa_free_cpumask(cpus);
+  }
+  return res;
+}
+
+// read a matrix written by sicm_latency_matrix, 0 if it covers all devices
+static int sicm_latency_load(const char* path, sicm_device_list* devs, int ninit, double* matrix) {
+  int init, node, page_size, found = 0;
+  char line[128];
+  unsigned int i;
+  double ns;
+  FILE* f;
+
+  f = fopen(path, "r");
+  if(f == NULL)
+    return -1;
+  for(i = 0; i < ninit * devs->count; i++)
+    matrix[i] = 0;
+  while(fgets(line, sizeof(line), f) != NULL) {
+    if(sscanf(line, "%d %d %d %lf", &init, &node, &page_size, &ns) != 4)
+      continue;
+    if(init < 0 || init >= ninit)
+      continue;
+    for(i = 0; i < devs->count; i++) {
+      if(sicm_numa_id(devs->devices[i]) == node &&
+         sicm_device_page_size(devs->devices[i]) == page_size) {
+        if(matrix[init * devs->count + i] == 0)
+          found++;
+        matrix[init * devs->count + i] = ns;
+      }
+    }
+  }
+  fclose(f);
+  return found == ninit * devs->count ? 0 : -1;
+}
+
+int sicm_latency_matrix(sicm_device_list* devs, size_t size, size_t iter, const char* cache, double* matrix) {
+  struct bitmask* cpus;
+  int ninit = numa_max_node() + 1, init;
+  unsigned int i;
+  double ns;
+  FILE* f;
+
+  if(devs == NULL || matrix == NULL)
+    return -EINVAL;
+  if(cache != NULL && sicm_latency_load(cache, devs, ninit, matrix) == 0)
+    return 0;
+
+  f = cache != NULL ? fopen(cache, "w") : NULL;
+  if(f != NULL)
+    fprintf(f, "# initiator node page_size(KiB) latency(ns)\n");
+  cpus = numa_allocate_cpumask();
+  for(init = 0; init < ninit; init++) {
+    // only nodes with CPUs can initiate
+    numa_bitmask_clearall(cpus);
+    numa_node_to_cpus(init, cpus);
+    for(i = 0; i < devs->count; i++) {
+      ns = numa_bitmask_weight(cpus) ? sicm_latency_chase(devs->devices[i], init, size, iter) : -1;
+      matrix[init * devs->count + i] = ns;
+      if(f != NULL)
+        fprintf(f, "%d %d %d %f\n", init, sicm_numa_id(devs->devices[i]),
+          sicm_device_page_size(devs->devices[i]), ns);
+    }
+  }
+  numa_free_cpumask(cpus);
+  if(f != NULL)
+    fclose(f);
+  return 0;
+}
+
 size_t sicm_bandwidth_linear2(struct sicm_device* device, size_t size,
     size_t (*kernel)(double*, double*, size_t)) {
   struct timespec start, end;
@@ -840,7 +1561,7 @@ size_t sicm_bandwidth_random3(struct sicm_device* device, size_t size,
 }
 
 size_t sicm_triad_kernel_linear(double* a, double* b, double* c, size_t size) {
-  int i;
+  size_t i;
   double scalar = 3.0;
   #pragma omp parallel for
   for(i = 0; i < size; i++) {
@@ -850,12 +1571,286 @@ size_t sicm_triad_kernel_linear(double* a, double* b, double* c, size_t size) {
 }
 
 size_t sicm_triad_kernel_random(double* a, double* b, double* c, size_t* indexes, size_t size) {
-  int i, idx;
+  size_t i;
   double scalar = 3.0;
   #pragma omp parallel for
   for(i = 0; i < size; i++) {
-    idx = indexes[i];
+    size_t idx = indexes[i];
     a[idx] = b[idx] + scalar * c[idx];
   }
   return size * (sizeof(size_t) + 3 * sizeof(double));
 }
+
+/*
+ * STREAM-style kernels for sicm_bandwidth. Each runs over the elements
+ * [lo, hi) of its arrays and returns the sum of the values read by
+ * SICM_BW_READ, which is otherwise 0. The vector versions need 64-byte
+ * aligned arrays and lo, and finish odd tails with the scalar version.
+ */
+typedef double (*sicm_bw_fn)(sicm_bw_kernel, double*, double*, double*, size_t, size_t, int);
+
+#define SICM_BW_SCALAR 3.0
+#define SICM_BW_MAX_THREADS 256
+
+static double sicm_bw_scalar(sicm_bw_kernel kernel, double* a, double* b, double* c,
+    size_t lo, size_t hi, int nt) {
+  double sum = 0;
+  size_t i;
+  switch(kernel) {
+    case SICM_BW_COPY:
+      for(i = lo; i < hi; i++) a[i] = b[i];
+      break;
+    case SICM_BW_SCALE:
+      for(i = lo; i < hi; i++) a[i] = SICM_BW_SCALAR * b[i];
+      break;
+    case SICM_BW_ADD:
+      for(i = lo; i < hi; i++) a[i] = b[i] + c[i];
+      break;
+    case SICM_BW_TRIAD:
+      for(i = lo; i < hi; i++) a[i] = b[i] + SICM_BW_SCALAR * c[i];
+      break;
+    case SICM_BW_READ:
+      for(i = lo; i < hi; i++) sum += b[i];
+      break;
+    case SICM_BW_WRITE:
+      for(i = lo; i < hi; i++) a[i] = SICM_BW_SCALAR;
+      break;
+  }
+  return sum;
+}
+
+#ifdef __x86_64__
+// one vector loop per kernel, storing either normally or non-temporally
+#define SICM_BW_LOOP(width, store, stream, expr) \
+  for(i = lo; i + (width) <= hi; i += (width)) { \
+    v = (expr); \
+    if(nt) stream(a + i, v); else store(a + i, v); \
+  }
+
+#define SICM_BW_VECTOR(name, isa, vec, width, set1, zero, load, add, mul, store, stream, reduce) \
+__attribute__((target(isa))) \
+static double name(sicm_bw_kernel kernel, double* a, double* b, double* c, \
+    size_t lo, size_t hi, int nt) { \
+  const vec s = set1(SICM_BW_SCALAR); \
+  vec v, sum = zero(); \
+  size_t i = lo; \
+  switch(kernel) { \
+    case SICM_BW_COPY: \
+      SICM_BW_LOOP(width, store, stream, load(b + i)) \
+      break; \
+    case SICM_BW_SCALE: \
+      SICM_BW_LOOP(width, store, stream, mul(s, load(b + i))) \
+      break; \
+    case SICM_BW_ADD: \
+      SICM_BW_LOOP(width, store, stream, add(load(b + i), load(c + i))) \
+      break; \
+    case SICM_BW_TRIAD: \
+      SICM_BW_LOOP(width, store, stream, add(load(b + i), mul(s, load(c + i)))) \
+      break; \
+    case SICM_BW_READ: \
+      for(i = lo; i + (width) <= hi; i += (width)) \
+        sum = add(sum, load(b + i)); \
+      break; \
+    case SICM_BW_WRITE: \
+      SICM_BW_LOOP(width, store, stream, s) \
+      break; \
+  } \
+  if(nt) \
+    _mm_sfence(); \
+  (void)v; \
+  return reduce(sum) + sicm_bw_scalar(kernel, a, b, c, i, hi, 0); \
+}
+
+__attribute__((target("avx2")))
+static double sicm_bw_sum256(__m256d v) {
+  __m128d x = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x)));
+}
+
+SICM_BW_VECTOR(sicm_bw_avx2, "avx2", __m256d, 4, _mm256_set1_pd, _mm256_setzero_pd,
+  _mm256_load_pd, _mm256_add_pd, _mm256_mul_pd, _mm256_store_pd, _mm256_stream_pd, sicm_bw_sum256)
+SICM_BW_VECTOR(sicm_bw_avx512, "avx512f", __m512d, 8, _mm512_set1_pd, _mm512_setzero_pd,
+  _mm512_load_pd, _mm512_add_pd, _mm512_mul_pd, _mm512_store_pd, _mm512_stream_pd, _mm512_reduce_add_pd)
+#endif
+
+// widest kernels this CPU supports
+static sicm_bw_fn sicm_bw_select(int flags) {
+  if(flags & SICM_BW_NOVECTOR)
+    return sicm_bw_scalar;
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+    return sicm_bw_avx512;
+  if(__builtin_cpu_supports("avx2"))
+    return sicm_bw_avx2;
+#endif
+  return sicm_bw_scalar;
+}
+
+typedef struct sicm_bw_work {
+  sicm_bw_fn fn;
+  sicm_bw_kernel kernel;
+  double *a, *b, *c;
+  size_t lo, hi;
+  int nt, initiator, reps;
+  pthread_mutex_t* start;
+  pthread_barrier_t* barrier;
+  double* times;  // seconds per repetition, filled by the first thread
+  double sum;
+} sicm_bw_work;
+
+static void* sicm_bw_worker(void* arg) {
+  sicm_bw_work* w = arg;
+  struct timespec start, end;
+  size_t i;
+  int r;
+
+  pthread_mutex_lock(w->start);
+  pthread_mutex_unlock(w->start);
+  if(w->initiator >= 0)
+    numa_run_on_node(w->initiator);
+
+  // first touch of the thread's own chunk
+  for(i = w->lo; i < w->hi; i++) {
+    w->a[i] = 1;
+    w->b[i] = 2;
+    w->c[i] = 3;
+  }
+
+  for(r = 0; r < w->reps; r++) {
+    pthread_barrier_wait(w->barrier);
+    if(w->times)
+      clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    w->sum += w->fn(w->kernel, w->a, w->b, w->c, w->lo, w->hi, w->nt);
+    pthread_barrier_wait(w->barrier);
+    if(w->times) {
+      clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+      w->times[r] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+  }
+  return NULL;
+}
+
+static int sicm_double_compare(const void* lhs, const void* rhs) {
+  double l = *(const double*)lhs, r = *(const double*)rhs;
+  return (l > r) - (l < r);
+}
+
+int sicm_bandwidth(sicm_device* device, int initiator, sicm_bw_kernel kernel, size_t size,
+    int reps, int nthreads, int flags, sicm_bw_result* res) {
+  static const size_t arrays[] = {
+    [SICM_BW_COPY] = 2, [SICM_BW_SCALE] = 2, [SICM_BW_ADD] = 3,
+    [SICM_BW_TRIAD] = 3, [SICM_BW_READ] = 1, [SICM_BW_WRITE] = 1,
+  };
+  sicm_bw_work work[SICM_BW_MAX_THREADS];
+  pthread_t threads[SICM_BW_MAX_THREADS];
+  pthread_mutex_t start = PTHREAD_MUTEX_INITIALIZER;
+  pthread_barrier_t barrier;
+  struct bitmask* cpus;
+  double *a, *b, *c, *times, bytes, mean, var;
+  size_t chunk, bufsize;
+  int i, n, ok, ret = 0;
+  sicm_bw_fn fn;
+  volatile double sink = 0;
+
+  if(device == NULL || res == NULL || reps < 1 || size == 0 ||
+     kernel < SICM_BW_COPY || kernel > SICM_BW_WRITE)
+    return -EINVAL;
+
+  // by default, one thread per CPU of the initiator node
+  if(nthreads <= 0) {
+    cpus = numa_allocate_cpumask();
+    if(initiator >= 0 && numa_node_to_cpus(initiator, cpus) == 0)
+      nthreads = numa_bitmask_weight(cpus);
+    numa_free_cpumask(cpus);
+    if(nthreads <= 0)
+      nthreads = numa_num_configured_cpus();
+  }
+  if(nthreads > SICM_BW_MAX_THREADS)
+    nthreads = SICM_BW_MAX_THREADS;
+
+  bufsize = size * sizeof(double);
+  a = sicm_device_alloc(device, bufsize);
+  b = sicm_device_alloc(device, bufsize);
+  c = sicm_device_alloc(device, bufsize);
+  times = malloc((reps + 1) * sizeof(double));
+  if(a == NULL || b == NULL || c == NULL || times == NULL) {
+    ret = -ENOMEM;
+    goto out;
+  }
+
+  fn = sicm_bw_select(flags);
+  if(((uintptr_t)a | (uintptr_t)b | (uintptr_t)c) & 63)
+    fn = sicm_bw_scalar;
+
+  // Workers wait on start until the caller knows how many of them could
+  // be created, then split the arrays in chunks of whole cache lines, so
+  // vector stores stay aligned. The calling thread is the first worker.
+  pthread_mutex_lock(&start);
+  work[0].start = &start;
+  for(n = 1; n < nthreads; n++) {
+    work[n].start = &start;
+    if(pthread_create(&threads[n], NULL, sicm_bw_worker, &work[n]) != 0)
+      break;
+  }
+  chunk = sicm_div_ceil(sicm_div_ceil(size, n), 8) * 8;
+  ok = pthread_barrier_init(&barrier, NULL, n) == 0;
+  for(i = 0; i < n; i++) {
+    work[i].fn = fn;
+    work[i].kernel = kernel;
+    work[i].a = a;
+    work[i].b = b;
+    work[i].c = c;
+    work[i].lo = i * chunk < size ? i * chunk : size;
+    work[i].hi = (i + 1) * chunk < size ? (i + 1) * chunk : size;
+    work[i].nt = flags & SICM_BW_NONTEMPORAL;
+    work[i].initiator = initiator;
+    work[i].reps = ok ? reps + 1 : 0;
+    work[i].barrier = &barrier;
+    work[i].times = i == 0 ? times : NULL;
+    work[i].sum = 0;
+  }
+  pthread_mutex_unlock(&start);
+
+  cpus = numa_allocate_cpumask();
+  numa_sched_getaffinity(0, cpus);
+  sicm_bw_worker(&work[0]);
+  numa_sched_setaffinity(0, cpus);
+  numa_free_cpumask(cpus);
+  for(i = 1; i < n; i++) {
+    pthread_join(threads[i], NULL);
+    sink += work[i].sum;
+  }
+  sink += work[0].sum;
+  if(!ok) {
+    ret = -EAGAIN;
+    goto out;
+  }
+  pthread_barrier_destroy(&barrier);
+
+  // the first repetition only warms up, like in STREAM
+  bytes = (double)arrays[kernel] * bufsize;
+  for(i = 0; i < reps; i++)
+    times[i] = bytes / times[i + 1] / 1e6;
+  qsort(times, reps, sizeof(double), sicm_double_compare);
+  mean = 0;
+  for(i = 0; i < reps; i++)
+    mean += times[i];
+  mean /= reps;
+  var = 0;
+  for(i = 0; i < reps; i++)
+    var += (times[i] - mean) * (times[i] - mean);
+  res->best = times[reps - 1];
+  res->median = reps % 2 ? times[reps / 2] : (times[reps / 2 - 1] + times[reps / 2]) / 2;
+  res->stddev = sqrt(var / reps);
+
+out:
+  free(times);
+  if(a)
+    sicm_device_free(device, a, bufsize);
+  if(b)
+    sicm_device_free(device, b, bufsize);
+  if(c)
+    sicm_device_free(device, c, bufsize);
+  return ret;
+}
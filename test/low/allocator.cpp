@@ -49,6 +49,26 @@ int main() {
         }
     }
 
+    // arena, freed with sicm_arena_free
+    {
+        sicm_arena arena = sicm_arena_create(0, SICM_ALLOC_RELAXED, &devs);
+        std::size_t size = 1;
+        for(std::size_t i = 0; i < 5; i++) {
+            std::vector <int, SICMAllocator <int> > vector(size, 0, SICMAllocator <int> (NULL, arena));
+            size *= 10;
+            vector.resize(size);
+        }
+
+        // allocators of different arenas can't free each other's memory
+        sicm_arena other = sicm_arena_create(0, SICM_ALLOC_RELAXED, &devs);
+        if (SICMAllocator <int> (NULL, arena) == SICMAllocator <int> (NULL, other) ||
+            SICMAllocator <int> (NULL, arena) != SICMAllocator <long> (NULL, arena)) {
+            return 1;
+        }
+        sicm_arena_destroy(other);
+        sicm_arena_destroy(arena);
+    }
+
 	sicm_fini();
     return 0;
 }
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sicm_low.h>
+
+#define COUNT 1000
+
+int main() {
+    sicm_init();
+    sicm_device *dev = sicm_default_device(0);
+    char *ptrs[COUNT];
+    char *again, *early;
+    size_t size;
+
+    if (!dev) {
+        return 0;
+    }
+
+    // mapped before the cache was enabled, so it must not end up in it
+    early = sicm_device_alloc(dev, 64);
+
+    if (sicm_device_cache_enable() != 0) {
+        fprintf(stderr, "Could not enable the device cache.\n");
+        return 1;
+    }
+
+    if (early) {
+        sicm_device_free(dev, early, 64);
+        again = sicm_device_alloc(dev, 64);
+        if (again == early) {
+            fprintf(stderr, "Memory from outside the cache was handed out by it.\n");
+            return 1;
+        }
+        sicm_device_free(dev, again, 64);
+    }
+
+    for(size = 1; size <= 4096; size *= 4) {
+        for(unsigned int i = 0; i < COUNT; i++) {
+            ptrs[i] = sicm_device_alloc(dev, size);
+            if (!ptrs[i]) {
+                fprintf(stderr, "Allocation %u of %zu bytes failed.\n", i, size);
+                return 1;
+            }
+            memset(ptrs[i], i & 0xff, size);
+        }
+
+        // objects must not overlap
+        for(unsigned int i = 0; i < COUNT; i++) {
+            if (ptrs[i][0] != (char) (i & 0xff) || ptrs[i][size - 1] != (char) (i & 0xff)) {
+                fprintf(stderr, "Allocation %u of %zu bytes was overwritten.\n", i, size);
+                return 1;
+            }
+        }
+
+        for(unsigned int i = 0; i < COUNT; i++) {
+            sicm_device_free(dev, ptrs[i], size);
+        }
+
+        // a freed object should be handed out again
+        again = sicm_device_alloc(dev, size);
+        if (size <= 2048 && again != ptrs[COUNT - 1]) {
+            fprintf(stderr, "Freed %zu-byte object was not reused.\n", size);
+            return 1;
+        }
+        sicm_device_free(dev, again, size);
+    }
+
+    sicm_fini();
+    return 0;
+}
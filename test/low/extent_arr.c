@@ -0,0 +1,231 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sicm_extent_arr.h>
+
+// slots of the reference, each can hold one extent at SLOT_ADDR(i)
+#define SLOTS 4096
+#define SLOT 4096
+#define SLOT_ADDR(i) ((char *) 0x10000000 + (uintptr_t) (i) * SLOT)
+#define OPS 200000
+
+#define READERS 4
+#define WRITER_OPS 200000
+
+static size_t len[SLOTS];	// 0 if the slot is empty
+
+static int check_lookup(extent_arr *a, unsigned int i, size_t off) {
+	extent_info info;
+	int found;
+
+	found = extent_arr_lookup(a, SLOT_ADDR(i) + off, &info);
+	if (found != (off < len[i])) {
+		fprintf(stderr, "lookup of slot %u + %zu returned %d\n", i, off, found);
+		return 1;
+	}
+	if (found && (info.start != SLOT_ADDR(i) || info.end != SLOT_ADDR(i) + len[i] ||
+	              info.arena != (void *) (uintptr_t) (i + 1))) {
+		fprintf(stderr, "lookup of slot %u + %zu returned the wrong extent\n", i, off);
+		return 1;
+	}
+	return 0;
+}
+
+static int check_order(extent_arr *a) {
+	extent_leaf *l;
+	size_t i, count;
+	char *prev;
+
+	count = 0;
+	prev = NULL;
+	extent_arr_lock(a);
+	extent_arr_for(a, l, i) {
+		if ((char *) l->ext[i].start <= prev) {
+			fprintf(stderr, "extents are out of order at %p\n", l->ext[i].start);
+			extent_arr_unlock(a);
+			return 1;
+		}
+		prev = l->ext[i].start;
+		count++;
+	}
+	extent_arr_unlock(a);
+
+	if (count != a->count) {
+		fprintf(stderr, "iterated over %zu extents instead of %zu\n", count, a->count);
+		return 1;
+	}
+	return 0;
+}
+
+// Randomized inserts, deletes and resizes against a reference array
+static int test_random(void) {
+	extent_arr *a;
+	unsigned int i, op;
+	size_t n, count;
+
+	a = extent_arr_init();
+	count = 0;
+	srand(1);
+
+	for(op = 0; op < OPS; op++) {
+		i = rand() % SLOTS;
+		switch(rand() % 4) {
+		case 0:
+		case 1:
+			if (len[i] == 0) {
+				len[i] = 1 + rand() % SLOT;
+				extent_arr_insert(a, SLOT_ADDR(i), SLOT_ADDR(i) + len[i], (void *) (uintptr_t) (i + 1));
+				count++;
+			} else {
+				extent_arr_delete(a, SLOT_ADDR(i));
+				len[i] = 0;
+				count--;
+			}
+			break;
+		case 2:
+			n = 1 + rand() % SLOT;
+			if (extent_arr_set_end(a, SLOT_ADDR(i), SLOT_ADDR(i) + n) != (len[i] != 0)) {
+				fprintf(stderr, "extent_arr_set_end of slot %u returned the wrong result\n", i);
+				return 1;
+			}
+			if (len[i] != 0)
+				len[i] = n;
+			break;
+		case 3:
+			// deleting what isn't there is a no-op
+			if (len[i] == 0)
+				extent_arr_delete(a, SLOT_ADDR(i));
+			break;
+		}
+
+		if (check_lookup(a, rand() % SLOTS, rand() % SLOT))
+			return 1;
+		if (a->count != count) {
+			fprintf(stderr, "index holds %zu extents instead of %zu\n", a->count, count);
+			return 1;
+		}
+		if (op % 10000 == 0 && check_order(a))
+			return 1;
+	}
+
+	for(i = 0; i < SLOTS; i++) {
+		if (check_lookup(a, i, 0) || check_lookup(a, i, len[i] ? len[i] - 1 : SLOT - 1))
+			return 1;
+	}
+	if (check_order(a))
+		return 1;
+
+	// empty the index, which collapses the tree back to a single leaf
+	for(i = 0; i < SLOTS; i++) {
+		if (len[i] != 0) {
+			extent_arr_delete(a, SLOT_ADDR(i));
+			len[i] = 0;
+		}
+	}
+	if (a->count != 0 || !a->root->leaf || check_order(a)) {
+		fprintf(stderr, "index isn't empty after deleting everything\n");
+		return 1;
+	}
+	for(i = 0; i < SLOTS; i++) {
+		if (check_lookup(a, i, 0))
+			return 1;
+	}
+
+	extent_arr_free(a);
+	return 0;
+}
+
+// The even slots hold extents that are never deleted, only resized between
+// SLOT / 2 and SLOT. The writer inserts and deletes extents in the odd slots
+// meanwhile, splitting and dropping nodes all over the tree.
+static extent_arr *shared;
+static int done;
+
+static void *reader(void *arg) {
+	unsigned int seed, i;
+	extent_info info;
+	size_t off;
+	int found;
+
+	seed = (uintptr_t) arg;
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		i = (rand_r(&seed) % (SLOTS / 2)) * 2;
+		off = rand_r(&seed) % (SLOT / 2);
+		found = extent_arr_lookup(shared, SLOT_ADDR(i) + off, &info);
+		if (!found || info.start != SLOT_ADDR(i) || info.arena != (void *) (uintptr_t) (i + 1) ||
+		    (info.end != SLOT_ADDR(i) + SLOT / 2 && info.end != SLOT_ADDR(i) + SLOT)) {
+			fprintf(stderr, "concurrent lookup of slot %u + %zu failed\n", i, off);
+			return (void *) 1;
+		}
+
+		// the upper half of an odd slot is never covered
+		i++;
+		found = extent_arr_lookup(shared, SLOT_ADDR(i) + SLOT / 2 + off, &info);
+		if (found) {
+			fprintf(stderr, "concurrent lookup of slot %u + %zu found %p\n", i, SLOT / 2 + off, info.start);
+			return (void *) 1;
+		}
+	}
+
+	return NULL;
+}
+
+static int test_concurrent(void) {
+	pthread_t threads[READERS];
+	unsigned int i, op;
+	void *ret;
+	int err;
+
+	shared = extent_arr_init();
+	for(i = 0; i < SLOTS; i += 2) {
+		len[i] = SLOT;
+		extent_arr_insert(shared, SLOT_ADDR(i), SLOT_ADDR(i) + SLOT, (void *) (uintptr_t) (i + 1));
+	}
+
+	for(i = 0; i < READERS; i++) {
+		if (pthread_create(&threads[i], NULL, reader, (void *) (uintptr_t) (i + 1)) != 0) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	}
+
+	srand(2);
+	for(op = 0; op < WRITER_OPS; op++) {
+		i = rand() % SLOTS;
+		if (i % 2 == 0) {
+			len[i] = len[i] == SLOT ? SLOT / 2 : SLOT;
+			extent_arr_set_end(shared, SLOT_ADDR(i), SLOT_ADDR(i) + len[i]);
+		} else if (len[i] == 0) {
+			len[i] = 1 + rand() % (SLOT / 2);
+			extent_arr_insert(shared, SLOT_ADDR(i), SLOT_ADDR(i) + len[i], (void *) (uintptr_t) (i + 1));
+		} else {
+			extent_arr_delete(shared, SLOT_ADDR(i));
+			len[i] = 0;
+		}
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	err = 0;
+	for(i = 0; i < READERS; i++) {
+		pthread_join(threads[i], &ret);
+		if (ret != NULL)
+			err = 1;
+	}
+
+	for(i = 0; i < SLOTS && !err; i++)
+		err = check_lookup(shared, i, 0) || check_lookup(shared, i, SLOT / 2);
+	if (!err)
+		err = check_order(shared);
+
+	extent_arr_free(shared);
+	return err;
+}
+
+int main() {
+	if (test_random())
+		return 1;
+	if (test_concurrent())
+		return 1;
+	return 0;
+}
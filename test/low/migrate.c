@@ -0,0 +1,84 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sicm_low.h>
+
+#define N 4096
+#define SZ 4096
+
+int main() {
+	unsigned int i;
+	int err;
+	char *bufs[N];
+	sicm_device_list devs, src, dst;
+	sicm_arena sa;
+	sicm_migration *m, *m2;
+	sicm_migration_status st;
+
+	devs = sicm_init();
+	src.count = 1;
+	src.devices = &devs.devices[0];
+
+	// move to another node if there is one, otherwise just rebind in place
+	dst = src;
+	for(i = 1; i < devs.count; i++) {
+		if (sicm_numa_id(devs.devices[i]) != sicm_numa_id(devs.devices[0]) &&
+		    sicm_device_page_size(devs.devices[i]) == sicm_device_page_size(devs.devices[0])) {
+			dst.devices = &devs.devices[i];
+			break;
+		}
+	}
+
+	sa = sicm_arena_create(0, 0, &src);
+	if (sa == NULL) {
+		fprintf(stderr, "sicm_arena_create failed\n");
+		return -1;
+	}
+
+	for(i = 0; i < N; i++) {
+		bufs[i] = sicm_arena_alloc(sa, SZ);
+		memset(bufs[i], i, SZ);
+	}
+
+	err = sicm_arena_migrate_start(sa, &dst, 4, &m);
+	if (err < 0) {
+		fprintf(stderr, "sicm_arena_migrate_start failed: %d\n", err);
+		return -1;
+	}
+
+	// only one migration at a time, unless the first one is already done
+	err = sicm_arena_migrate_start(sa, &dst, 4, &m2);
+	if (err == 0)
+		sicm_migration_free(m2);
+	else if (err != -EBUSY) {
+		fprintf(stderr, "second sicm_arena_migrate_start failed: %d\n", err);
+		return -1;
+	}
+
+	// the arena stays usable while it is being moved
+	for(i = 0; i < N; i += 2) {
+		sicm_free(bufs[i]);
+		bufs[i] = sicm_arena_alloc(sa, SZ);
+		memset(bufs[i], i, SZ);
+	}
+
+	err = sicm_migration_wait(m, &st);
+	if (err != 0 || !st.done || st.moved + st.failed != st.total || st.nfailures != 0) {
+		fprintf(stderr, "migration failed: %d, %zu of %zu bytes moved\n", err, st.moved, st.total);
+		return -1;
+	}
+	sicm_migration_free(m);
+
+	for(i = 0; i < N; i++) {
+		if (bufs[i][SZ - 1] != (char) i) {
+			fprintf(stderr, "data corrupted by the migration\n");
+			return -1;
+		}
+		sicm_free(bufs[i]);
+	}
+
+	sicm_arena_destroy(sa);
+	sicm_fini();
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sicm_low.h>
+
+#define N 1024
+#define SZ 256
+
+struct root {
+	size_t n;
+	char *bufs[N];
+};
+
+int main() {
+	unsigned int i;
+	char path[] = "/tmp/sicm_persist_XXXXXX";
+	int fd;
+	sicm_device_list devs, dram;
+	sicm_device *dev;
+	sicm_arena sa;
+	struct root *r;
+	void *base;
+
+	devs = sicm_init();
+	dev = sicm_find_device(&devs, SICM_DRAM, 0, NULL);
+	if (dev == NULL) {
+		fprintf(stderr, "no DRAM device\n");
+		return -1;
+	}
+	dram.count = 1;
+	dram.devices = &dev;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	close(fd);
+
+	sa = sicm_arena_open_persistent(path, 256 << 20, 0, &dram, NULL);
+	if (sa == NULL) {
+		fprintf(stderr, "sicm_arena_open_persistent failed\n");
+		goto fail;
+	}
+
+	r = sicm_arena_alloc(sa, sizeof(struct root));
+	r->n = N;
+	for(i = 0; i < N; i++) {
+		r->bufs[i] = sicm_arena_alloc(sa, SZ);
+		memset(r->bufs[i], i, SZ);
+	}
+	sicm_arena_set_root(sa, r);
+	base = r;
+
+	if (sicm_arena_sync(sa) != 0) {
+		fprintf(stderr, "sicm_arena_sync failed\n");
+		goto fail;
+	}
+	sicm_arena_destroy(sa);
+
+	// reattach and check that the data and pointers survived
+	sa = sicm_arena_open_persistent(path, 0, 0, &dram, NULL);
+	if (sa == NULL) {
+		fprintf(stderr, "reopening the arena failed\n");
+		goto fail;
+	}
+
+	r = sicm_arena_get_root(sa);
+	if (r != base || r->n != N) {
+		fprintf(stderr, "wrong root: %p\n", (void *) r);
+		goto fail;
+	}
+
+	for(i = 0; i < N; i++) {
+		if (r->bufs[i][0] != (char) i || r->bufs[i][SZ - 1] != (char) i) {
+			fprintf(stderr, "wrong data in buffer %u\n", i);
+			goto fail;
+		}
+	}
+
+	// new allocations don't overlap the old ones
+	for(i = 0; i < N; i++) {
+		char *buf = sicm_arena_alloc(sa, SZ);
+		if (buf == NULL || (buf >= (char *) r && buf < r->bufs[N - 1] + SZ)) {
+			fprintf(stderr, "bad allocation after reopening: %p\n", buf);
+			goto fail;
+		}
+	}
+
+	sicm_arena_destroy(sa);
+	unlink(path);
+	sicm_fini();
+	return 0;
+
+fail:
+	unlink(path);
+	return -1;
+}
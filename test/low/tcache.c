@@ -0,0 +1,68 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <sicm_low.h>
+
+#define NTHREADS 8
+#define N 10000
+
+sicm_device_list devs;
+sicm_arena sa;
+
+static void *worker(void *arg) {
+	int i;
+	char *bufs[N];
+
+	for(i = 0; i < N; i++) {
+		bufs[i] = sicm_arena_alloc(sa, 16 + (i % 256));
+		if (bufs[i] == NULL || sicm_arena_lookup(bufs[i]) != sa)
+			return (void *) 1;
+	}
+
+	for(i = 0; i < N; i++) {
+		sicm_free(bufs[i]);
+	}
+
+	return NULL;
+}
+
+int main() {
+	int i, err;
+	pthread_t threads[NTHREADS];
+	void *ret;
+	sicm_device_list ds;
+
+	devs = sicm_init();
+	ds.count = 1;
+	ds.devices = &devs.devices[0];
+	sa = sicm_arena_create(0, SICM_ALLOC_TCACHE, &ds);
+	if (sa == NULL) {
+		fprintf(stderr, "sicm_arena_create failed\n");
+		return -1;
+	}
+
+	err = 0;
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+	for(i = 0; i < NTHREADS; i++) {
+		pthread_join(threads[i], &ret);
+		if (ret != NULL)
+			err = -1;
+	}
+
+	if (err) {
+		fprintf(stderr, "allocation ended up outside of the arena\n");
+		return -1;
+	}
+
+	// the main thread's tcache has to be flushed after the move
+	if (worker(NULL) != NULL || sicm_arena_set_devices(sa, &ds) < 0 || worker(NULL) != NULL) {
+		fprintf(stderr, "allocation after move failed\n");
+		return -1;
+	}
+
+	sicm_arena_destroy(sa);
+	sicm_fini();
+
+	return 0;
+}
@@ -0,0 +1,35 @@
+#include <stdio.h>
+
+#include <sicm_low.h>
+
+int main() {
+    sicm_device_list devs = sicm_init();
+    sicm_tier_list tiers = sicm_device_tiers(-1);
+    unsigned int total = 0;
+
+    for(unsigned int i = 0; i < tiers.count; i++) {
+        total += tiers.tiers[i].count;
+    }
+    if (total != devs.count) {
+        fprintf(stderr, "Tiers hold %u devices instead of %u.\n", total, devs.count);
+        return 1;
+    }
+
+    for(unsigned int i = 0; i < devs.count; i++) {
+        sicm_device *dev = devs.devices[i];
+
+        if (sicm_device_tier(&tiers, dev) < 0) {
+            fprintf(stderr, "Device %u is not in any tier.\n", i);
+            return 1;
+        }
+
+        if (sicm_node_device(sicm_numa_id(dev), sicm_device_page_size(dev)) != dev) {
+            fprintf(stderr, "Lookup of device %u by node and page size failed.\n", i);
+            return 1;
+        }
+    }
+
+    sicm_tier_list_free(&tiers);
+    sicm_fini();
+    return 0;
+}